@@ -0,0 +1,618 @@
+#include "Chip8Emu.h"
+#include "Chip8Lockstep.h"
+#include "Chip8Runner.h"
+#include "Framebuffer.h"
+#include "Rewind.h"
+#include "RomPack.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Usage: Chip8Bench [--rom file] [--json file]
+// --rom picks the ROM for the dispatch, scaling and lockstep sections (default Invaders.ch8),
+// --json is where the machine-readable results go (default bench.json).
+
+// Every number the benchmark prints is also collected here and written out as JSON, so runs can be diffed
+struct BenchResult
+{
+	std::string group;
+	std::string name;
+	double value;
+	std::string unit;
+};
+
+static std::vector<BenchResult> results;
+
+static void Report(const std::string& group, const std::string& name, double value, const char* unit)
+{
+	results.push_back({ group, name, value, unit });
+}
+
+static std::string JsonEscape(const std::string& text)
+{
+	std::string escaped;
+	for (char c : text)
+	{
+		if (c == '"' || c == '\\')
+		{
+			escaped += '\\';
+		}
+		escaped += c;
+	}
+	return escaped;
+}
+
+static bool WriteJson(const char* filename, const char* romName)
+{
+	std::ofstream json(filename);
+	if (!json)
+	{
+		return false;
+	}
+
+	json << "{\n  \"rom\": \"" << JsonEscape(romName) << "\",\n  \"results\": [\n";
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const BenchResult& result = results[i];
+		json << "    { \"group\": \"" << JsonEscape(result.group) << "\", \"name\": \"" << JsonEscape(result.name)
+			<< "\", \"value\": " << result.value << ", \"unit\": \"" << JsonEscape(result.unit) << "\" }"
+			<< (i + 1 < results.size() ? ",\n" : "\n");
+	}
+	json << "  ]\n}\n";
+	return static_cast<bool>(json);
+}
+
+// Discards std::cout while it exists. Some ROMs (FontTest.ch8) run into unknown opcodes, whose console
+// messages would otherwise be what gets measured.
+class QuietConsole
+{
+public:
+	QuietConsole() : saved(std::cout.rdbuf(nullptr)) {}
+	~QuietConsole()
+	{
+		std::cout.rdbuf(saved);
+		std::cout.clear();
+	}
+
+private:
+	std::streambuf* saved;
+};
+
+static const char* DispatchName(Dispatch dispatch)
+{
+	switch (dispatch)
+	{
+	case Dispatch::Switch: return "Switch";
+	case Dispatch::Table: return "Table";
+	case Dispatch::Cached: return "Cached";
+	case Dispatch::Jit: return "Jit";
+	}
+	return "?";
+}
+
+static const char* EngineName(LockstepEngine engine)
+{
+	switch (engine)
+	{
+	case LockstepEngine::Scalar: return "Scalar";
+	case LockstepEngine::Avx2: return "Avx2";
+	case LockstepEngine::Avx512: return "Avx512";
+	}
+	return "?";
+}
+
+// Runs a ROM headless for a fixed number of cycles with the given dispatch engine, returns instructions/sec.
+// Idle skipping is off, it fast-forwards the same idle loops on every engine and would hide their differences.
+double BenchmarkDispatch(const char* romName, Dispatch dispatch, int updates, int cyclesPerUpdate)
+{
+	Chip8Emu emu;
+	emu.Start();
+	emu.dispatch = dispatch;
+	emu.idleSkip = false;
+	emu.cycleUntilDraw = false;
+	emu.cyclesPerUpdate = cyclesPerUpdate;
+	if (!emu.LoadRom(romName))
+	{
+		std::cout << "Failed to open " << romName << std::endl;
+		return 0.0;
+	}
+
+	QuietConsole quiet;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < updates; i++)
+	{
+		emu.Update();
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	return static_cast<double>(updates) * cyclesPerUpdate / elapsed.count();
+}
+
+// Synthetic programs, each a tight loop dominated by one class of opcode. They start at 0x200 and jump
+// back to their loop start, the first words set up registers.
+struct OpcodeProgram
+{
+	const char* name;
+	std::vector<unsigned short> code;
+};
+
+static const OpcodeProgram opcodePrograms[] =
+{
+	// ALU: 8XY0..8XYE and 7XNN
+	{ "ALU", { 0x6001, 0x6102, 0x8014, 0x8125, 0x8016, 0x810E, 0x8203, 0x8231, 0x8312, 0x8017, 0x7001, 0x1204 } },
+	// Skips that are never taken, so the loop stays straight: 3XNN, 4XNN, 5XY0, 9XY0, EX9E with no key down
+	{ "Skips", { 0x6000, 0x6101, 0x3001, 0x4000, 0x5010, 0x9000, 0xE09E, 0x3102, 0x1204 } },
+	// DXYN drawing the same font sprite, which toggles it on and off
+	{ "DXYN", { 0xA000, 0x6000, 0xD015, 0xD015, 0xD015, 0xD015, 0xD015, 0xD015, 0xD015, 0x1204 } },
+	// FX55/FX65 moving all 16 registers to and from 0x300
+	{ "FX55/FX65", { 0xA300, 0x6000, 0xFF55, 0xFF65, 0xFF55, 0xFF65, 0xFF55, 0xFF65, 0xFF55, 0x1204 } },
+};
+
+// Calls Chip8Emu::Cycle directly on one synthetic program, returns instructions/sec
+double BenchmarkOpcodeClass(const OpcodeProgram& program, Dispatch dispatch, int cycles)
+{
+	Chip8Emu emu;
+	emu.Start();
+	emu.dispatch = dispatch;
+	for (size_t i = 0; i < program.code.size(); i++)
+	{
+		emu.memory[0x200 + i * 2] = program.code[i] >> 8;
+		emu.memory[0x200 + i * 2 + 1] = program.code[i] & 0xFF;
+	}
+	emu.InvalidateDecoded(0x200, static_cast<unsigned int>(program.code.size() * 2));
+
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < cycles; i++)
+	{
+		emu.Cycle();
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	return cycles / elapsed.count();
+}
+
+static volatile uint32_t framebufferSink; // Keeps the expanded pixels observable so the loop isn't optimized away
+
+// Times FramebufferExpander::Expand the way OnUserUpdate uses it, on a 64x32 draw target. Returns frames/sec.
+double BenchmarkFramebuffer(uint32_t dirtyRows, int frames)
+{
+	FramebufferExpander expander;
+	expander.SetColors(0xFFFFFFFF, 0xFF000000);
+
+	std::vector<uint32_t> pixels(64 * 32);
+	uint64_t rows[32];
+	for (int y = 0; y < 32; y++)
+	{
+		rows[y] = 0x9E3779B97F4A7C15ull * (y + 1);
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < frames; i++)
+	{
+		rows[i & 31] ^= 1ull << (i & 63); // Keep the input changing so the work can't be hoisted
+		expander.Expand(rows, dirtyRows, pixels.data(), 64);
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	framebufferSink = pixels[0];
+	return frames / elapsed.count();
+}
+
+// Runs the same ROM on two emulators built over memory holding different garbage and compares their
+// serialized states byte for byte. Anything Initialize leaves unset shows up as a difference.
+bool CheckSavestateDeterminism(const char* romName)
+{
+	using Storage = std::aligned_storage_t<sizeof(Chip8Emu), alignof(Chip8Emu)>;
+	std::string states[2];
+	for (int run = 0; run < 2; run++)
+	{
+		std::unique_ptr<Storage> storage(new Storage);
+		std::memset(storage.get(), run == 0 ? 0x00 : 0xA5, sizeof(Storage));
+		Chip8Emu* emu = new (storage.get()) Chip8Emu;
+		emu->Start();
+		emu->LoadRom(romName);
+		emu->RunCycles(1000);
+		unsigned long long applied;
+		emu->QueueKeys(emu->GetCycleCount() + 100, 0x10, applied); // One slot in use, the rest must still be zero
+
+		std::ostringstream out;
+		emu->WriteState(out);
+		states[run] = out.str();
+		emu->~Chip8Emu();
+	}
+
+	bool same = states[0] == states[1];
+	std::cout << "Savestate determinism: " << (same ? "identical" : "states differ between identical runs") << std::endl;
+	return same;
+}
+
+// Times SaveState and LoadState on a running game, the cost rewind and run-ahead pay per snapshot
+void BenchmarkSavestate(const char* romName, int iterations)
+{
+	Chip8Emu emu;
+	emu.Start();
+	if (!emu.LoadRom(romName))
+	{
+		std::cout << "Failed to open " << romName << std::endl;
+		return;
+	}
+	emu.RunCycles(10000);
+
+	Chip8State state;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < iterations; i++)
+	{
+		emu.SaveState(state);
+	}
+	std::chrono::duration<double> saveTime = std::chrono::steady_clock::now() - start;
+
+	start = std::chrono::steady_clock::now();
+	for (int i = 0; i < iterations; i++)
+	{
+		emu.LoadState(state);
+	}
+	std::chrono::duration<double> loadTime = std::chrono::steady_clock::now() - start;
+
+	double saveNs = saveTime.count() / iterations * 1e9;
+	double loadNs = loadTime.count() / iterations * 1e9;
+	std::cout << "Savestate: " << sizeof(Chip8State) << " bytes" << std::endl;
+	std::cout << "  Save: " << saveNs << " ns" << std::endl;
+	std::cout << "  Load: " << loadNs << " ns" << std::endl;
+	Report("savestate", "Save", saveNs, "ns");
+	Report("savestate", "Load", loadNs, "ns");
+}
+
+// Plays frames of a ROM, capturing a rewind snapshot at the start of each one like RenderingEngine does.
+// Reports the capture cost and how much one snapshot takes in the rewind buffer.
+void BenchmarkRewind(const char* romName, int frames)
+{
+	Chip8Emu emu;
+	emu.Start();
+	if (!emu.LoadRom(romName))
+	{
+		std::cout << "Failed to open " << romName << std::endl;
+		return;
+	}
+
+	RewindBuffer rewind(64 * 1024 * 1024);
+	std::chrono::duration<double> captureTime(0);
+	for (int i = 0; i < frames; i++)
+	{
+		auto start = std::chrono::steady_clock::now();
+		Chip8State state;
+		emu.SaveState(state);
+		rewind.Push(state);
+		captureTime += std::chrono::steady_clock::now() - start;
+
+		emu.RunCycles(emu.CyclesUntilTimerTick());
+	}
+
+	double captureUs = captureTime.count() / frames * 1e6;
+	double bytesPerFrame = static_cast<double>(rewind.BytesUsed()) / rewind.Count();
+	std::cout << "Rewind: " << frames << " frames" << std::endl;
+	std::cout << "  Capture: " << captureUs << " us per frame (" << captureUs / (1e6 / 60) * 100 << "% of a 60 Hz frame)" << std::endl;
+	std::cout << "  Size: " << bytesPerFrame << " bytes per frame, " << bytesPerFrame * 3600 / 1024 << " KB per minute" << std::endl;
+	Report("rewind", "Capture", captureUs, "us");
+	Report("rewind", "Bytes per frame", bytesPerFrame, "bytes");
+}
+
+// Times run-ahead the way RenderingEngine does it: after each real frame, save, run ahead frames, restore.
+// Reports the added cost per presented frame for a few run-ahead depths.
+void BenchmarkRunAhead(const char* romName, int frames)
+{
+	std::cout << "Run-ahead: " << frames << " frames" << std::endl;
+	for (int ahead : { 1, 2, 4, 8 })
+	{
+		Chip8Emu emu;
+		emu.Start();
+		if (!emu.LoadRom(romName))
+		{
+			std::cout << "Failed to open " << romName << std::endl;
+			return;
+		}
+
+		std::chrono::duration<double> aheadTime(0);
+		for (int i = 0; i < frames; i++)
+		{
+			emu.RunCycles(emu.CyclesUntilTimerTick());
+
+			auto start = std::chrono::steady_clock::now();
+			Chip8State present;
+			emu.SaveState(present);
+			for (int j = 0; j < ahead; j++)
+			{
+				emu.RunCycles(emu.CyclesUntilTimerTick());
+			}
+			emu.LoadState(present);
+			aheadTime += std::chrono::steady_clock::now() - start;
+		}
+
+		double microseconds = aheadTime.count() / frames * 1e6;
+		std::cout << "  " << ahead << " frames ahead: " << microseconds << " us per frame ("
+			<< microseconds / (1e6 / 60) * 100 << "% of a 60 Hz frame)" << std::endl;
+		Report("runahead", std::to_string(ahead) + " frames", microseconds, "us");
+	}
+}
+
+// Reads a ROM a character at a time through ifstream, the way LoadRom used to, as the baseline for BenchmarkRomLoading
+static bool LoadRomStream(Chip8Emu& emu, const char* romName)
+{
+	std::ifstream romFile(romName, std::ios::binary);
+	if (!romFile)
+	{
+		return false;
+	}
+
+	std::vector<unsigned char> image;
+	char c;
+	while (romFile.get(c) && image.size() < Chip8Emu::MaxRomSize)
+	{
+		image.push_back(static_cast<unsigned char>(c));
+	}
+	return emu.LoadRom(image.data(), image.size());
+}
+
+// Times getting ROMs into an emulator: streamed from their files, mapped from their files with LoadRom,
+// and out of one ROM pack that's opened once (the batch runner case)
+void BenchmarkRomLoading(const char* const romNames[], int romCount, int iterations)
+{
+	// The pack is scratch, built in the temp directory and removed again so runs leave nothing behind
+	std::error_code tempError;
+	std::string packName = (std::filesystem::temp_directory_path(tempError) / "chip8bench.c8pk").string();
+	std::string error;
+	RomPack pack;
+	if (tempError || !RomPack::Write(packName.c_str(), std::vector<std::string>(romNames, romNames + romCount), error) || !pack.Open(packName.c_str()))
+	{
+		std::cout << "Failed to build " << packName << " (" << error << ")" << std::endl;
+		std::filesystem::remove(packName, tempError);
+		return;
+	}
+
+	Chip8Emu emu;
+	emu.Start();
+	int loads = iterations * romCount;
+
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < loads; i++)
+	{
+		LoadRomStream(emu, romNames[i % romCount]);
+	}
+	double streamUs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / loads * 1e6;
+
+	start = std::chrono::steady_clock::now();
+	for (int i = 0; i < loads; i++)
+	{
+		emu.LoadRom(romNames[i % romCount]);
+	}
+	double mappedUs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / loads * 1e6;
+
+	start = std::chrono::steady_clock::now();
+	for (int i = 0; i < loads; i++)
+	{
+		RomPack::Rom rom = pack.Get(i % pack.Count());
+		emu.LoadRom(rom.data, rom.size);
+	}
+	double packUs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / loads * 1e6;
+	pack.Close();
+	std::filesystem::remove(packName, tempError);
+
+	std::cout << "ROM loading: " << loads << " loads of " << romCount << " ROMs" << std::endl;
+	std::cout << "  ifstream: " << streamUs << " us per ROM" << std::endl;
+	std::cout << "  Mapped file: " << mappedUs << " us per ROM" << std::endl;
+	std::cout << "  ROM pack: " << packUs << " us per ROM" << std::endl;
+	Report("romload", "ifstream", streamUs, "us");
+	Report("romload", "Mapped file", mappedUs, "us");
+	Report("romload", "ROM pack", packUs, "us");
+}
+
+// Runs the same batch of jobs with 1, 2, 4... threads up to the hardware thread count, reports aggregate throughput
+void BenchmarkScaling(const char* romName, int jobCount, unsigned long long cyclesPerJob)
+{
+	std::vector<RunnerJob> jobs(jobCount);
+	for (int i = 0; i < jobCount; i++)
+	{
+		jobs[i].romPath = romName;
+		jobs[i].cycles = cyclesPerJob;
+		jobs[i].seed = i;
+	}
+
+	std::cout << "Runner scaling: " << jobCount << " instances x " << cyclesPerJob << " cycles" << std::endl;
+
+	int maxThreads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+	double singleRate = 0.0;
+	for (int threads = 1; ; threads = std::min(threads * 2, maxThreads))
+	{
+		Chip8Runner runner;
+		runner.threadCount = threads;
+
+		auto start = std::chrono::steady_clock::now();
+		runner.Run(jobs);
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+		double rate = static_cast<double>(jobCount) * cyclesPerJob / elapsed.count();
+		if (threads == 1)
+		{
+			singleRate = rate;
+		}
+		std::cout << "  " << threads << " threads: " << rate / 1e6 << " M instructions/sec (" << rate / singleRate << "x)" << std::endl;
+		Report("scaling", std::to_string(threads) + " threads", rate, "instructions/sec");
+
+		if (threads == maxThreads)
+		{
+			break;
+		}
+	}
+}
+
+// Runs Chip8Lockstep::Lanes seeded instances of one ROM in lockstep and the same instances one after another
+// on the scalar core, reports aggregate throughput of both
+void BenchmarkLockstep(const char* romName, int batches, int cyclesPerBatch)
+{
+	const int lanes = Chip8Lockstep::Lanes;
+	const double instructions = static_cast<double>(lanes) * batches * cyclesPerBatch;
+	std::cout << "Lockstep: " << lanes << " lanes x " << static_cast<long long>(batches) * cyclesPerBatch << " cycles" << std::endl;
+
+	auto start = std::chrono::steady_clock::now();
+	{
+		QuietConsole quiet;
+		for (int lane = 0; lane < lanes; lane++)
+		{
+			Chip8Emu emu;
+			emu.Start();
+			emu.dispatch = Dispatch::Cached;
+			emu.idleSkip = false; // The lockstep core runs every instruction too
+			emu.LoadRom(romName);
+			emu.Seed(lane);
+			for (int i = 0; i < batches; i++)
+			{
+				emu.RunCycles(cyclesPerBatch);
+			}
+		}
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	double baselineRate = instructions / elapsed.count();
+	std::cout << "  Chip8Emu (Cached): " << baselineRate / 1e6 << " M instructions/sec" << std::endl;
+	Report("lockstep", "Chip8Emu", baselineRate, "instructions/sec");
+
+	// Every engine the CPU can run, so the vector engines are compared against the scalar lanes as well
+	for (LockstepEngine engine : { LockstepEngine::Scalar, LockstepEngine::Avx2, LockstepEngine::Avx512 })
+	{
+		if (!Chip8Lockstep::EngineSupported(engine))
+		{
+			std::cout << "  " << EngineName(engine) << ": not supported" << std::endl;
+			continue;
+		}
+
+		std::unique_ptr<Chip8Lockstep> lockstep(new Chip8Lockstep());
+		lockstep->engine = engine;
+		lockstep->Start();
+		if (!lockstep->LoadRom(romName))
+		{
+			std::cout << "Failed to open " << romName << std::endl;
+			return;
+		}
+		for (int lane = 0; lane < lanes; lane++)
+		{
+			lockstep->Seed(lane, lane);
+		}
+
+		start = std::chrono::steady_clock::now();
+		for (int i = 0; i < batches; i++)
+		{
+			lockstep->RunCycles(cyclesPerBatch);
+		}
+		elapsed = std::chrono::steady_clock::now() - start;
+		double rate = instructions / elapsed.count();
+
+		std::cout << "  " << EngineName(engine) << ": " << rate / 1e6 << " M instructions/sec (" << rate / baselineRate << "x, "
+			<< lockstep->LaneUtilization() * 100.0 << "% lane utilization)" << std::endl;
+		Report("lockstep", EngineName(engine), rate, "instructions/sec");
+		if (engine == LockstepEngine::Scalar)
+		{
+			Report("lockstep", "Lane utilization", lockstep->LaneUtilization(), "fraction");
+		}
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	const char* romName = "Invaders.ch8";
+	const char* jsonName = "bench.json";
+	for (int i = 1; i < argc; i++)
+	{
+		if (std::strcmp(argv[i], "--rom") == 0 && i + 1 < argc)
+		{
+			romName = argv[++i];
+		}
+		else if (std::strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+		{
+			jsonName = argv[++i];
+		}
+		else
+		{
+			std::cout << "Usage: Chip8Bench [--rom file] [--json file]" << std::endl;
+			return 2;
+		}
+	}
+
+	const Dispatch engines[] = { Dispatch::Switch, Dispatch::Table, Dispatch::Cached, Dispatch::Jit };
+	const int updates = 10000;
+	const int cyclesPerUpdate = 1000;
+
+	std::cout << "Dispatch benchmark: " << romName << ", " << updates * cyclesPerUpdate << " cycles per run" << std::endl;
+	for (Dispatch dispatch : engines)
+	{
+		double rate = BenchmarkDispatch(romName, dispatch, updates, cyclesPerUpdate);
+		std::cout << "  " << DispatchName(dispatch) << ": " << rate / 1e6 << " M instructions/sec" << std::endl;
+		Report("dispatch", DispatchName(dispatch), rate, "instructions/sec");
+	}
+
+	const int opcodeCycles = 5000000;
+	std::cout << "Opcode classes: " << opcodeCycles << " cycles per run" << std::endl;
+	for (const OpcodeProgram& program : opcodePrograms)
+	{
+		for (Dispatch dispatch : { Dispatch::Switch, Dispatch::Cached })
+		{
+			double rate = BenchmarkOpcodeClass(program, dispatch, opcodeCycles);
+			std::cout << "  " << program.name << " (" << DispatchName(dispatch) << "): " << rate / 1e6 << " M instructions/sec" << std::endl;
+			Report("opcode", std::string(program.name) + "/" + DispatchName(dispatch), rate, "instructions/sec");
+		}
+	}
+
+	const char* bundledRoms[] = { "Invaders.ch8", "FontTest.ch8", "chip8notepad.ch8" };
+	std::cout << "Bundled ROMs: " << 2000 * cyclesPerUpdate << " cycles per run" << std::endl;
+	for (const char* rom : bundledRoms)
+	{
+		for (Dispatch dispatch : { Dispatch::Switch, Dispatch::Cached, Dispatch::Jit })
+		{
+			double rate = BenchmarkDispatch(rom, dispatch, 2000, cyclesPerUpdate);
+			std::cout << "  " << rom << " (" << DispatchName(dispatch) << "): " << rate / 1e6 << " M instructions/sec" << std::endl;
+			Report("rom", std::string(rom) + "/" + DispatchName(dispatch), rate, "instructions/sec");
+		}
+	}
+
+	const int framebufferFrames = 200000;
+	std::cout << "Framebuffer conversion: " << framebufferFrames << " frames per run" << std::endl;
+	double fullRate = BenchmarkFramebuffer(0xFFFFFFFF, framebufferFrames);
+	std::cout << "  All rows: " << fullRate << " frames/sec (" << fullRate * 64 * 32 / 1e6 << " M pixels/sec)" << std::endl;
+	Report("framebuffer", "All rows", fullRate, "frames/sec");
+	double partialRate = BenchmarkFramebuffer(0x0000F00F, framebufferFrames);
+	std::cout << "  8 dirty rows: " << partialRate << " frames/sec" << std::endl;
+	Report("framebuffer", "8 dirty rows", partialRate, "frames/sec");
+
+	if (!CheckSavestateDeterminism(romName))
+	{
+		return 1;
+	}
+	BenchmarkSavestate(romName, 1000000);
+
+	BenchmarkRewind(romName, 3600);
+
+	BenchmarkRunAhead(romName, 3600);
+
+	BenchmarkRomLoading(bundledRoms, 3, 2000);
+
+	BenchmarkScaling(romName, 64, 2000000);
+
+	BenchmarkLockstep(romName, 1000, 1000);
+
+	if (!WriteJson(jsonName, romName))
+	{
+		std::cout << "Failed to write " << jsonName << std::endl;
+		return 1;
+	}
+	std::cout << "Results written to " << jsonName << std::endl;
+
+	return 0;
+}
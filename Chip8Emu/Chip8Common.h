@@ -0,0 +1,63 @@
+#pragma once
+#include <cstdint>
+
+// Machine details Chip8Emu and Chip8Lockstep must agree on bit for bit, so a lockstep lane and a Chip8Emu
+// given the same ROM, seed and keys produce the same frames.
+
+inline constexpr unsigned char chip8Fontset[5 * 16] =
+{
+	0b11110000,
+	0b10010000,
+	0b10010000,
+	0b10010000,
+	0b11110000,
+	0x20, 0x60, 0x20, 0x20, 0x70, // 1
+	0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
+	0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
+	0x90, 0x90, 0xF0, 0x10, 0x10, // 4
+	0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
+	0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
+	0xF0, 0x10, 0x20, 0x40, 0x40, // 7
+	0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
+	0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
+	0xF0, 0x90, 0xF0, 0x90, 0x90, // A
+	0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
+	0xF0, 0x80, 0x80, 0x80, 0xF0, // C
+	0xE0, 0x90, 0x90, 0x90, 0xE0, // D
+	0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
+	0xF0, 0x80, 0xF0, 0x80, 0x80  // F
+};
+
+// CXNN random number state for a seed. splitmix64 spreads similar seeds apart and xorshift needs a non-zero state.
+inline uint64_t Chip8RandomState(uint64_t seed)
+{
+	uint64_t z = seed + 0x9E3779B97F4A7C15ull;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	z ^= z >> 31;
+	return z != 0 ? z : 0x9E3779B97F4A7C15ull;
+}
+
+// xorshift64*, returns a uniformly distributed byte
+inline unsigned char Chip8NextRandom(uint64_t& state)
+{
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return static_cast<unsigned char>((state * 0x2545F4914F6CDD1Dull) >> 56);
+}
+
+// FNV-1a over the display rows, for comparing runs without keeping whole frames around
+inline uint64_t Chip8FrameHash(const uint64_t (&gfxRows)[32])
+{
+	uint64_t hash = 0xCBF29CE484222325ull;
+	for (uint64_t row : gfxRows)
+	{
+		for (int byte = 0; byte < 8; byte++)
+		{
+			hash ^= (row >> (byte * 8)) & 0xFF;
+			hash *= 0x100000001B3ull;
+		}
+	}
+	return hash;
+}
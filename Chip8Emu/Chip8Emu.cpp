@@ -1,13 +1,207 @@
 #include "Chip8Emu.h"
+#include "Chip8Common.h"
+#include "MappedFile.h"
+#include "X64Emitter.h"
 
-#include <array>
-#include <stack>
+#include <algorithm>
+#include <climits>
+#include <cstring>
 #include <iostream>
 #include <iomanip>
-#include <stdlib.h>
-#include <fstream>
+#include <map>
 #include <sstream>
 
+// Opcode tracing is compiled in only when CHIP8_TRACE is defined (the Debug configurations do this).
+// Without it the trace messages are never formatted, so the release interpreter builds no streams at all.
+#ifdef CHIP8_TRACE
+#define CHIP8_LOG(message) \
+	do \
+	{ \
+		if (debugFlag) \
+		{ \
+			std::ostringstream traceStream; \
+			traceStream << std::hex << std::uppercase << message; \
+			Log(opcode, traceStream); \
+		} \
+	} while (0)
+#else
+#define CHIP8_LOG(message) do {} while (0)
+#endif
+
+// Profiling counters are compiled in only when CHIP8_PROFILE is defined, otherwise counting costs nothing.
+// Every execution path (Cycle, RunBlocks and the skipped cycles of SkipIdle) counts what it runs.
+#ifdef CHIP8_PROFILE
+#define CHIP8_PROFILE_COUNT(address, op, count) \
+	do \
+	{ \
+		profileAddresses[(address) & 0xFFF] += (count); \
+		profileOpcodes[HandlerIndex(op)] += (count); \
+	} while (0)
+#else
+#define CHIP8_PROFILE_COUNT(address, op, count) do {} while (0)
+#endif
+
+// The Jit engine emits x86-64 code, other targets run it as Cached
+#if defined(_M_X64) || defined(__x86_64__)
+#define CHIP8_JIT
+
+// Translated code keeps the Chip8State pointer in RBX and the Chip8Emu pointer in RBP, which the System V and
+// Windows x64 conventions both preserve across calls. V0-VF and I live in R10-R15 while a block uses them
+// (BlockRegisters) and are written back before any handler call and when the block ends, so memory is exactly
+// what the interpreter would have left whenever anything else can look at it. pc is known at translation time
+// and only stored when the block leaves. RAX, RCX, RDX, R8 and R9 are scratch within one instruction.
+typedef X64Emitter Asm;
+#ifdef _WIN32
+static const Asm::Reg argumentRegisters[2] = { Asm::RCX, Asm::RDX };
+#else
+static const Asm::Reg argumentRegisters[2] = { Asm::RDI, Asm::RSI };
+#endif
+
+static const size_t blockMemorySize = 256 * 1024; // Room for a few thousand typical blocks
+
+static Asm::Mem StateField(size_t offset, Asm::Reg index = Asm::NoReg, int scale = 1)
+{
+	return { Asm::RBX, static_cast<int32_t>(offset), index, scale };
+}
+
+static Asm::Mem VRegister(unsigned int x)
+{
+	return StateField(offsetof(Chip8State, V) + x);
+}
+
+// Guest registers cached in host registers for the length of one block. A guest register is loaded on first
+// use and stays in its host register, written back only when it's evicted (least recently used first) or
+// spilled. Everything emitted here is a plain load or store, so it never disturbs the flags between a compare
+// and the instruction that uses them. Cached V values are kept zero-extended bytes, I a zero-extended word.
+class BlockRegisters
+{
+public:
+	static const unsigned int IndexSlot = 16; // I, after the slots for V0-VF
+
+	BlockRegisters()
+	{
+		for (Slot& slot : slots)
+		{
+			slot = { -1, false, 0 };
+		}
+	}
+
+	// Host register holding the guest register's current value
+	Asm::Reg Read(Asm& out, unsigned int guest)
+	{
+		return Use(out, guest, true, false);
+	}
+
+	// Host register holding the guest register, which the caller is about to change in place
+	Asm::Reg Modify(Asm& out, unsigned int guest)
+	{
+		return Use(out, guest, true, true);
+	}
+
+	// Host register to put the guest register's new value in, the old one isn't loaded
+	Asm::Reg Write(Asm& out, unsigned int guest)
+	{
+		return Use(out, guest, false, true);
+	}
+
+	// Whether host has held a guest register at any point of the block
+	bool Used(Asm::Reg host) const
+	{
+		for (int i = 0; i < hostCount; i++)
+		{
+			if (hosts[i] == host)
+			{
+				return (usedMask >> i & 1) != 0;
+			}
+		}
+		return false;
+	}
+
+	// Writes back every changed guest register and forgets them all, before code that reads or clobbers
+	// them (a handler call, the end of the block)
+	void Spill(Asm& out)
+	{
+		for (int i = 0; i < hostCount; i++)
+		{
+			Evict(out, i);
+		}
+	}
+
+private:
+	struct Slot
+	{
+		int guest; // -1 when free
+		bool dirty;
+		unsigned int lastUse;
+	};
+
+	static const int hostCount = 6;
+	static constexpr Asm::Reg hosts[hostCount] = { Asm::R10, Asm::R11, Asm::R12, Asm::R13, Asm::R14, Asm::R15 };
+
+	Asm::Reg Use(Asm& out, unsigned int guest, bool load, bool dirty)
+	{
+		int found = -1;
+		for (int i = 0; i < hostCount && found < 0; i++)
+		{
+			if (slots[i].guest == static_cast<int>(guest))
+			{
+				found = i;
+			}
+		}
+
+		// The first free host register, or else the least recently used one. The current instruction's operands
+		// were used last, so they're never the ones evicted.
+		if (found < 0)
+		{
+			found = 0;
+			for (int i = 1; i < hostCount; i++)
+			{
+				if (slots[found].guest >= 0 && (slots[i].guest < 0 || slots[i].lastUse < slots[found].lastUse))
+				{
+					found = i;
+				}
+			}
+			Evict(out, found);
+			slots[found].guest = static_cast<int>(guest);
+			if (load && guest == IndexSlot)
+			{
+				out.LoadWord(hosts[found], StateField(offsetof(Chip8State, I)));
+			}
+			else if (load)
+			{
+				out.LoadByte(hosts[found], VRegister(guest));
+			}
+		}
+
+		slots[found].dirty = slots[found].dirty || dirty;
+		slots[found].lastUse = ++clock;
+		usedMask |= 1u << found;
+		return hosts[found];
+	}
+
+	void Evict(Asm& out, int host)
+	{
+		Slot& slot = slots[host];
+		if (slot.guest >= 0 && slot.dirty)
+		{
+			if (slot.guest == static_cast<int>(IndexSlot))
+			{
+				out.StoreWord(StateField(offsetof(Chip8State, I)), hosts[host]);
+			}
+			else
+			{
+				out.StoreByte(VRegister(static_cast<unsigned int>(slot.guest)), hosts[host]);
+			}
+		}
+		slot = { -1, false, 0 };
+	}
+
+	Slot slots[hostCount];
+	unsigned int clock = 0;
+	unsigned int usedMask = 0; // Bit n: hosts[n] has been used
+};
+#endif
+
 // Use this for initialization
 void Chip8Emu::Start()
 {
@@ -16,15 +210,28 @@ void Chip8Emu::Start()
 
 void Chip8Emu::Initialize()
 {
+	// Every byte of the state, padding and unused key event slots included, starts at zero, so saved states
+	// and rewind deltas only depend on what the machine did
+	std::memset(static_cast<Chip8State*>(this), 0, sizeof(Chip8State));
+
 	pc = 0x200;  // Program counter starts at 0x200
-	opcode = 0;      // Reset current opcode	
+	opcode = 0;      // Reset current opcode
 	I = 0;      // Reset index register
+	currentCycle = 0;
+	timerAccumulator = 0;
+	drawCount = 0;
 
 	// Clear display
-	std::fill(std::begin(gfx), std::end(gfx), 0);
+	std::fill(std::begin(gfxRows), std::end(gfxRows), 0);
+	drawFlag = false;
+
+	// Clear keypad
+	keys = 0;
+	keyEventCount = 0;
 
 	// Clear stack
-	stack = {};
+	std::fill(std::begin(stack), std::end(stack), 0);
+	sp = 0;
 
 	// Clear registers V0-VF
 	std::fill(std::begin(V), std::end(V), 0);
@@ -33,527 +240,1636 @@ void Chip8Emu::Initialize()
 	std::fill(std::begin(memory), std::end(memory), 0);
 
 	// Load fontset
-	for (int i = 0; i < 80; ++i)
-	{
-		memory[i] = chip8_fontset[i];
-	}
+	std::copy(std::begin(chip8Fontset), std::end(chip8Fontset), memory);
+
+	// Drop all decoded instructions
+	decodeCache.resize(4096);
+	std::fill(std::begin(decodedMask), std::end(decodedMask), 0);
+	FlushBlocks();
 
 	// Reset timers
 	delay_timer = 0;
 	sound_timer = 0;
+
+	Seed(rngSeed);
+	ResetProfile();
 }
 
-void Chip8Emu::Update()
+void Chip8Emu::Seed(uint64_t seed)
 {
-	for (int i = 0; i < cyclesPerUpdate; i++)
-	{
-		// Run emulator cycle
-		Cycle();
+	rngSeed = seed;
+	rngState = Chip8RandomState(seed);
+}
 
-		currentCycle++;
+unsigned char Chip8Emu::NextRandom()
+{
+	return Chip8NextRandom(rngState);
+}
 
-		// Update timers
-		if (delay_timer > 0)
-		{
-			//std::cout << (int)delay_timer << std::endl;
+// Maps the file and copies it in one block, false if it can't be opened or doesn't fit in memory
+bool Chip8Emu::LoadRom(const char* filename)
+{
+	MappedFile file;
+	return file.Open(filename) && LoadRom(file.Data(), file.Size());
+}
 
-			if (currentCycle % cyclesPerTimerDecrement == 0)
-			{
-				delay_timer--;
-			}
-		}
-		if (sound_timer > 0)
-		{
-			//if (!audioSource.isPlaying)
-			//{
-			//	audioSource.Play();
-			//}
+bool Chip8Emu::LoadRom(const unsigned char* data, size_t size)
+{
+	if (size > MaxRomSize)
+	{
+		return false;
+	}
 
-			if (currentCycle % cyclesPerTimerDecrement == 0)
-			{
-				sound_timer--;
-			}
+	if (size > 0)
+	{
+		std::memcpy(memory + 0x200, data, size);
+	}
+	InvalidateDecoded(0x200, static_cast<unsigned int>(size));
+	romHash = HashBytes(memory + 0x200, size);
+	return true;
+}
 
-			if (sound_timer == 0) // Play sound when crossing to 0 (This may be wrong, check here: http://devernay.free.fr/hacks/chip8/C8TECH10.HTM#2.5)
-			{
-				//	audioSource.Stop();
-			}
+void Chip8Emu::InvalidateDecoded(unsigned int address, unsigned int length)
+{
+	// An instruction starting one byte before the write also reads the first written byte
+	unsigned int first = address > 0 ? address - 1 : 0;
+	unsigned int last = address + length;
+	for (unsigned int i = first; i < last && i < 4096; i++)
+	{
+		decodedMask[i >> 6] &= ~(1ull << (i & 63));
+
+		// Translated blocks are dropped together before the next block is entered
+		if (blockCodeMask[i >> 6] & (1ull << (i & 63)))
+		{
+			blocksStale = true;
 		}
 	}
 }
 
-void Chip8Emu::Cycle()
+void Chip8Emu::Update()
 {
-	// Fetch opcode
-	opcode = static_cast<unsigned short>(memory[pc] << 8 | memory[pc + 1]);
-	//std::cout << "Current opcode: 0x" << std::hex << opcode << std::dec << std::endl;
-		
-	// Decode and execute opcode
-	Execute();
+	if (cycleUntilDraw)
+	{
+		// End the update on a completed display write, so a sprite change never straddles two host frames
+		RunUntil(RunEvent::Draw, maxCyclesPerDraw);
+	}
+	else
+	{
+		RunCycles(cyclesPerUpdate);
+	}
 }
 
-void Chip8Emu::Execute()
+int Chip8Emu::RunCycles(int cycles)
 {
-	unsigned char X;
-	unsigned char Y;
-	unsigned char N;
-	unsigned short NN;
-	unsigned short NNN;
-	std::ostringstream stringStream;
-	stringStream << std::hex << std::uppercase;
+	return RunUntil(RunEvent::NoEvent, cycles);
+}
 
-	switch (opcode & 0xF000)
+// Runs up to maxCycles instructions, stopping early after the instruction that raises event.
+// Execution is split at timer ticks and queued key changes so the timers and keypad are only looked at
+// when they can change, not once per instruction. Translated blocks that can't observe either may run on
+// past a split (never past maxCycles), the ticks they ran over are then applied together.
+int Chip8Emu::RunUntil(RunEvent event, int maxCycles)
+{
+	int executed = 0;
+	while (executed < maxCycles)
 	{
-	case 0x0000:
-		if (opcode == 0x00E0) // Clears screen
-		{
-			Log(opcode, "Clear screen");
-			std::fill(std::begin(gfx), std::end(gfx), 0);
-			drawFlag = true;
-			pc += 2;
-		}
-		else if (opcode == 0x00EE) // Return from subroutine
-		{
-			Log(opcode, "Return from subroutine");
-			pc = stack.top();
-			stack.pop();
-			pc += 2;
-		}
-		else
-		{
-			std::cout << "Unknown opcode: 0x" << std::hex << opcode << std::dec << std::endl;
-		}
-		break;
-
-	case 0x1000: // 1NNN: Jump to NNN
-		NNN = opcode & 0x0FFF;
-		stringStream << "Jumped to " << NNN;
-		Log(opcode, stringStream);
-		pc = NNN;
-		break;
+		ApplyKeyEvents(currentCycle);
+		int chunk = std::min({ CyclesUntilTimerTick(), CyclesUntilKeyEvent(), maxCycles - executed });
 
-	case 0x2000: // 2NNN: Call subroutine at NNN
-		NNN = opcode & 0x0FFF;
-		stringStream << "Called subroutine at " << NNN;
-		Log(opcode, stringStream);
-		stack.push(pc);
-		pc = NNN;
-		break;
-
-	case 0x3000: // 3XNN: Skips the next instruction if VX equals NN.
-		X = (opcode & 0x0F00) >> 8;
-		NN = opcode & 0x00FF;
-		if (V[X] == NN)
+		bool raised = false;
+		int done = 0;
+		if (idleSkip && !debugFlag)
 		{
-			stringStream << "Skipped next instruction (V" << static_cast<int>(X) << " == " << NN << ")";
-			Log(opcode, stringStream);
-			pc += 4;
+			done = SkipIdle(chunk);
 		}
-		else
+		if (done < chunk)
 		{
-			stringStream << "Continue to next instruction (V" << static_cast<int>(X) << " != " << NN << ")";
-			Log(opcode, stringStream);
-			pc += 2;
+			done += RunInstructions(chunk - done, maxCycles - executed - done, event, raised);
 		}
-		break;
+		currentCycle += done;
+		executed += done;
 
-	case 0x4000: // 4XNN: Skips the next instruction if VX doesn't equal NN.
-		X = (opcode & 0x0F00) >> 8;
-		NN = opcode & 0x00FF;
-		if (V[X] != NN)
+		// Every instruction is 60/instructionsPerSecond of a timer tick
+		timerAccumulator += 60u * static_cast<unsigned int>(done);
+		while (timerAccumulator >= static_cast<unsigned int>(instructionsPerSecond))
 		{
-			stringStream << "Skipped next instruction (V" << static_cast<int>(X) << " != " << NN << ")";
-			Log(opcode, stringStream);
-			pc += 4;
+			timerAccumulator -= instructionsPerSecond;
+			TickTimers();
 		}
-		else
-		{
-			stringStream << "Continue to next instruction (V" << static_cast<int>(X) << " == " << NN << ")";
-			Log(opcode, stringStream);
-			pc += 2;
-		}
-		break;
 
-	case 0x5000: // 5XY0: Skips the next instruction if VX equals VY.
-		X = (opcode & 0x0F00) >> 8;
-		Y = (opcode & 0x00F0) >> 4;
-		if (V[X] == V[Y])
+		if (raised)
 		{
-			stringStream << "Skipped next instruction (V" << static_cast<int>(X) << " == V" << static_cast<int>(Y) << ")";
-			Log(opcode, stringStream);
-			pc += 4;
-		}
-		else
-		{
-			stringStream << "Continue to next instruction (V" << static_cast<int>(X) << " != V" << static_cast<int>(Y) << ")";
-			Log(opcode, stringStream);
-			pc += 2;
+			break;
 		}
-		break;
+	}
 
-	case 0x6000: // 6XNN: Sets VX to NN.
-		X = (opcode & 0x0F00) >> 8;
-		NN = (opcode & 0x00FF);
-		stringStream << "Set V" << static_cast<int>(X) << " to " << NN;
-		Log(opcode, stringStream);
-		V[X] = static_cast<unsigned char>(NN);
-		pc += 2;
-		break;
+	// Changes a translated block ran past are due before an instruction that has already run, so they're applied
+	// now, as stepping would have done on the way. One due at the current cycle still waits for its instruction.
+	if (currentCycle > 0)
+	{
+		ApplyKeyEvents(currentCycle - 1);
+	}
+	return executed;
+}
 
-	case 0x7000: // 7XNN: Adds NN to VX.
-		X = (opcode & 0x0F00) >> 8;
-		NN = (opcode & 0x00FF);
-		stringStream << "Added " << NN << " to V" << static_cast<int>(X);
-		Log(opcode, stringStream);
-		V[X] += static_cast<unsigned char>(NN);
-		pc += 2;
-		break;
+// Runs count instructions with no timer bookkeeping, returns how many ran before event was raised.
+// The Jit engine may run more, up to limit (see RunBlocks).
+int Chip8Emu::RunInstructions(int count, int limit, RunEvent event, bool& raised)
+{
+	if (dispatch == Dispatch::Jit && !debugFlag && JitReady())
+	{
+		return RunBlocks(count, limit, event, raised);
+	}
 
-	case 0x8000:
-		switch (opcode & 0x000F)
+	if (event == RunEvent::NoEvent)
+	{
+		for (int i = 0; i < count; i++)
 		{
-		case 0x0: // 8XY0: Sets VX to the value of VY.
-			X = (opcode & 0x0F00) >> 8;
-			Y = (opcode & 0x00F0) >> 4;
-			stringStream << "Set V" << static_cast<int>(X) << " to the value of V" << static_cast<int>(Y);
-			Log(opcode, stringStream);
-			V[X] = V[Y];
-			pc += 2;
-			break;
+			Cycle();
+		}
+		return count;
+	}
 
-		case 0x1: // 8XY1: Sets VX to VX | VY.
-			X = (opcode & 0x0F00) >> 8;
-			Y = (opcode & 0x00F0) >> 4;
-			stringStream << "Set V" << static_cast<int>(X) << " to V" << static_cast<int>(X) << " | V" << static_cast<int>(Y);
-			Log(opcode, stringStream);
-			V[X] |= V[Y];
-			pc += 2;
-			break;
+	unsigned int drawsBefore = drawCount;
+	for (int i = 0; i < count; i++)
+	{
+		Cycle();
+		if (drawCount != drawsBefore)
+		{
+			raised = true;
+			return i + 1;
+		}
+	}
+	return count;
+}
 
-		case 0x2: // 8XY2: Sets VX to VX & VY.
-			X = (opcode & 0x0F00) >> 8;
-			Y = (opcode & 0x00F0) >> 4;
-			stringStream << "Set V" << static_cast<int>(X) << " to V" << static_cast<int>(X) << " & V" << static_cast<int>(Y);
-			Log(opcode, stringStream);
-			V[X] &= V[Y];
-			pc += 2;
-			break;
+// Recognizes loops that can't change anything but the cycle count before the next timer tick or input change,
+// and accounts for as many of their cycles (up to count) as step-by-step execution would have spent in them.
+// Returns the number of cycles skipped, 0 if pc isn't at an idle loop.
+int Chip8Emu::SkipIdle(int count)
+{
+	if (pc + 5 >= 4096)
+	{
+		return 0;
+	}
 
-		case 0x3: // 8XY3: Sets VX to VX xor VY.
-			X = (opcode & 0x0F00) >> 8;
-			Y = (opcode & 0x00F0) >> 4;
-			stringStream << "Set V" << static_cast<int>(X) << " to V" << static_cast<int>(X) << " xor V" << static_cast<int>(Y);
-			Log(opcode, stringStream);
-			V[X] ^= V[Y];
-			pc += 2;
-			break;
+	unsigned short op = static_cast<unsigned short>(memory[pc] << 8 | memory[pc + 1]);
+
+	// 1NNN jumping to itself
+	if (op == (0x1000 | pc))
+	{
+		opcode = op;
+		CHIP8_PROFILE_COUNT(pc, op, count);
+		return count;
+	}
 
-		case 0x4: // 8XY4: Adds VY to VX. VF is set to 1 when there's a carry, and to 0 when there isn't.
+	// FX0A with no key down repeats without side effects
+	if ((op & 0xF0FF) == 0xF00A)
+	{
+		if (keys != 0)
 		{
-			X = (opcode & 0x0F00) >> 8;
-			Y = (opcode & 0x00F0) >> 4;
-			int temp = V[X] + V[Y];
-			if (temp > 0xFF) // Carry if exeeds byte
-			{
-				stringStream << "Added V" << static_cast<int>(Y) << " to V" << static_cast<int>(X) << ". Carry, VF will be set to 1.";
-				Log(opcode, stringStream);
-				V[0xF] = 1;
-			}
-			else
-			{
-				stringStream << "Added V" << static_cast<int>(Y) << " to V" << static_cast<int>(X) << ". No carry, VF will be set to 0.";
-				Log(opcode, stringStream);
-				V[0xF] = 0;
-			}
-			V[X] += V[Y];
-			pc += 2;
+			return 0;
 		}
-		break;
+		opcode = op;
+		CHIP8_PROFILE_COUNT(pc, op, count);
+		return count;
+	}
 
-		case 0x5: // 8XY5: VY is subtracted from VX. VF is set to 0 when there's a borrow, and 1 when there isn't.
+	// FX07, 3XNN, 1NNN back to the FX07: polls the delay timer until it reaches NN.
+	// Between timer ticks every pass is identical, so whole passes can be skipped.
+	if ((op & 0xF0FF) == 0xF007)
+	{
+		unsigned char x = (op & 0x0F00) >> 8;
+		unsigned short skip = static_cast<unsigned short>(memory[pc + 2] << 8 | memory[pc + 3]);
+		unsigned short jump = static_cast<unsigned short>(memory[pc + 4] << 8 | memory[pc + 5]);
+		if ((skip & 0xFF00) == (0x3000 | x << 8) && jump == (0x1000 | pc) && delay_timer != (skip & 0x00FF))
 		{
-			X = (opcode & 0x0F00) >> 8;
-			Y = (opcode & 0x00F0) >> 4;
-			int temp = V[X] - V[Y];
-			if (temp < 0) // Don't carry if borrow in subtract
-			{
-				stringStream << "Subtracted V" << static_cast<int>(Y) << " from V" << static_cast<int>(X) << ". Borrow, VF will be set to 0.";
-				Log(opcode, stringStream);
-				V[0xF] = 0;
-			}
-			else
+			int passes = count / 3;
+			if (passes > 0)
 			{
-				stringStream << "Subtracted V" << static_cast<int>(Y) << " from V" << static_cast<int>(X) << ". No borrow, VF will be set to 1.";
-				Log(opcode, stringStream);
-				V[0xF] = 1;
+				V[x] = delay_timer;
+				opcode = jump;
+				CHIP8_PROFILE_COUNT(pc, op, passes);
+				CHIP8_PROFILE_COUNT(pc + 2, skip, passes);
+				CHIP8_PROFILE_COUNT(pc + 4, jump, passes);
 			}
-			V[X] -= V[Y];
-			pc += 2;
+			return passes * 3;
 		}
-		break;
+	}
 
-		case 0x6: // 8XY6: Shifts VX right by one. VF is set to the value of the least significant bit of VX before the shift.
-			X = (opcode & 0x0F00) >> 8;
-			stringStream << "Bit shifted V" << static_cast<int>(X) << " right by one. VF now contains least significant bit.";
-			Log(opcode, stringStream);
-			V[0xF] = (V[X] & 0x1);
-			V[X] = (V[X] >> 1);
-			pc += 2;
-			break;
+	return 0;
+}
 
-		case 0x7: // 8XY7: Sets VX to VY minus VX. VF is set to 0 when there's a borrow, and 1 when there isn't.
-		{
-			X = (opcode & 0x0F00) >> 8;
-			Y = (opcode & 0x00F0) >> 4;
-			int temp = V[Y] - V[X];
-			if (temp < 0) // Don't carry if borrow in subtract
-			{
-				stringStream << "Set V" << static_cast<int>(X) << " to V" << static_cast<int>(Y) << " minus V" << X << " Borrow, VF will be set to 0.";
-				Log(opcode, stringStream);
-				V[0xF] = 0;
-			}
-			else
-			{
-				stringStream << "Set V" << static_cast<int>(X) << " to V" << static_cast<int>(Y) << " minus V" << X << " No borrow, VF will be set to 1.";
-				Log(opcode, stringStream);
-				V[0xF] = 1;
-			}
-			V[X] = V[Y] - V[X];
-			pc += 2;
-		}
-		break;
+// Instructions left until the next 60 Hz timer tick, the point at which RunCycles has to stop and look at the timers
+int Chip8Emu::CyclesUntilTimerTick() const
+{
+	// A state loaded from a run at a lower speed can already be past its tick
+	if (timerAccumulator >= static_cast<unsigned int>(instructionsPerSecond))
+	{
+		return 1;
+	}
+	unsigned int remaining = static_cast<unsigned int>(instructionsPerSecond) - timerAccumulator;
+	return std::max(1, static_cast<int>((remaining + 59) / 60));
+}
 
-		case 0xE: // 8XYE: Shifts VX left by one. VF is set to the value of the most significant bit of VX before the shift. // TODO: Questionable VF logic?
-			X = (opcode & 0x0F00) >> 8;
-			stringStream << "Bit shifted V" << static_cast<int>(X) << " left by one. VF now contains most significant bit.";
-			Log(opcode, stringStream);
-			V[0xF] = V[X] & 0x80;
-			V[X] = V[X] << 1;
-			pc += 2;
-			break;
+// Zero would never let a timer tick and RunUntil would spin on it, so the speed is at least 1. The progress towards
+// the next tick is kept, reduced below the new tick interval so a slower speed doesn't leave it overdue.
+void Chip8Emu::SetInstructionsPerSecond(int ips)
+{
+	instructionsPerSecond = std::max(1, ips);
+	timerAccumulator %= static_cast<unsigned int>(instructionsPerSecond);
+}
 
-		default:
-			std::cout << "Unknown opcode: 0x" << std::hex << opcode << std::dec << std::endl;
-			break;
-		}
-		break;
+int Chip8Emu::GetInstructionsPerSecond() const
+{
+	return instructionsPerSecond;
+}
+
+unsigned long long Chip8Emu::GetCycleCount() const
+{
+	return currentCycle;
+}
 
-	case 0x9000: // 9XY0: Skips the next instruction if VX doesn't equal VY.
-		X = (opcode & 0x0F00) >> 8;
-		Y = (opcode & 0x00F0) >> 4;
-		if (V[X] != V[Y])
+unsigned short Chip8Emu::GetKeys() const
+{
+	return keys;
+}
+
+void Chip8Emu::SetKeys(unsigned short mask)
+{
+	keys = mask;
+}
+
+// Queues a keypad change for the instruction boundary at cycle, so input lands where it happened
+// rather than wherever the host next got around to polling. Events apply in the order they're queued,
+// one for an earlier cycle than the last queued (or the current) one applies at that cycle instead.
+// A key released in the same cycle it was pressed is held for one more instruction, so the press
+// can't vanish between two instructions. A full queue first applies the events due now; if none are,
+// nothing is queued and the caller has to run up to the next event (CyclesUntilKeyEvent) and retry.
+bool Chip8Emu::QueueKeys(unsigned long long cycle, unsigned short mask, unsigned long long& applied)
+{
+	cycle = std::max(cycle, currentCycle);
+	if (keyEventCount > 0)
+	{
+		const KeyEvent& last = keyEvents[keyEventCount - 1];
+		unsigned short before = keyEventCount > 1 ? keyEvents[keyEventCount - 2].keys : keys;
+		unsigned short pressed = last.keys & ~before;
+		cycle = std::max(cycle, last.cycle);
+		if (cycle == last.cycle && (pressed & ~mask) != 0)
 		{
-			stringStream << "Skipped next instruction (V" << static_cast<int>(X) << " != V" << static_cast<int>(Y) << ")";
-			Log(opcode, stringStream);
-			pc += 4;
+			cycle++;
 		}
-		else
+	}
+
+	const int capacity = sizeof(keyEvents) / sizeof(keyEvents[0]);
+	if (keyEventCount == capacity)
+	{
+		ApplyKeyEvents(currentCycle);
+		if (keyEventCount == capacity)
 		{
-			stringStream << "Continue to next instruction (V" << static_cast<int>(X) << " == V" << static_cast<int>(Y) << ")";
-			Log(opcode, stringStream);
-			pc += 2;
+			return false;
 		}
-		break;
+	}
+	keyEvents[keyEventCount++] = { cycle, mask };
+	applied = cycle;
+	return true;
+}
 
-	case 0xA000: // ANNN: Sets I to the address NNN
-		NNN = opcode & 0x0FFF;
-		stringStream << "Set I to the address " << NNN;
-		Log(opcode, stringStream);
-		I = NNN;
-		pc += 2;
-		break;
+void Chip8Emu::ClearKeyEvents()
+{
+	keyEventCount = 0;
+}
 
-	case 0xB000: // BNNN: Jumps to the address NNN plus V0.
-		NNN = opcode & 0x0FFF;
-		stringStream << "Jump to the address " << NNN << " plus V0";
-		Log(opcode, stringStream);
-		pc = V[0] + NNN;
-		break;
+// Applies every queued event that is due before the instruction at cycle
+void Chip8Emu::ApplyKeyEvents(unsigned long long cycle)
+{
+	int due = 0;
+	while (due < keyEventCount && keyEvents[due].cycle <= cycle)
+	{
+		keys = keyEvents[due].keys;
+		due++;
+	}
+	if (due > 0)
+	{
+		// The vacated entries are cleared, so a saved state doesn't depend on how many events were applied at once
+		std::copy(keyEvents + due, keyEvents + keyEventCount, keyEvents);
+		std::fill(keyEvents + keyEventCount - due, keyEvents + keyEventCount, KeyEvent());
+		keyEventCount = static_cast<unsigned char>(keyEventCount - due);
+	}
+}
 
-	case 0xC000: // CXNN: Sets VX to the result of a bitwise and operation on a random number and NN.
-		Log(opcode, "Set VX to the result of a bitwise and operation on a random number and NN.");
-		V[(opcode & 0x0F00) >> 8] = static_cast<unsigned char>((opcode & 0x00FF) & rand() % 255);
-		pc += 2;
-		break;
+// Instructions left until the next queued key change, RunUntil stops there to apply it. Running this far
+// makes room in a full queue.
+int Chip8Emu::CyclesUntilKeyEvent() const
+{
+	if (keyEventCount == 0)
+	{
+		return INT_MAX;
+	}
+	return static_cast<int>(std::min<unsigned long long>(keyEvents[0].cycle - currentCycle, INT_MAX));
+}
 
-	case 0xD000: // DXYN: Draw sprite at location VX,VY on screen. Sprite is N lines high.
+void Chip8Emu::TickTimers()
+{
+	// Update timers
+	if (delay_timer > 0)
+	{
+		//std::cout << (int)delay_timer << std::endl;
+		delay_timer--;
+	}
+	if (sound_timer > 0)
 	{
-		X = (opcode & 0x0F00) >> 8;
-		Y = (opcode & 0x00F0) >> 4;
-		N = opcode & 0x000F;
-		unsigned short x = V[X];
-		unsigned short y = V[Y];
-		unsigned short sourcePixel;
+		//if (!audioSource.isPlaying)
+		//{
+		//	audioSource.Play();
+		//}
 
-		stringStream << "Draw sprite at location V" << static_cast<int>(X) << ",V" << static_cast<int>(Y) << " (" << std::dec << x << "," << y << std::hex << ") on screen. Sprite is " << static_cast<int>(N) << " lines high.";
-		Log(opcode, stringStream);
+		sound_timer--;
 
-		V[0xF] = 0;
-		for (int yline = 0; yline < N; yline++)
+		if (sound_timer == 0) // Play sound when crossing to 0 (This may be wrong, check here: http://devernay.free.fr/hacks/chip8/C8TECH10.HTM#2.5)
 		{
-			sourcePixel = memory[I + yline];
-			for (int xline = 0; xline < 8; xline++)
-			{
-				if ((sourcePixel & (0x80 >> xline)) != 0)
-				{
-					int outputPixel = x + xline + ((y + yline) * 64);
-
-					if (outputPixel >= 64 * 32)
-					{
-						std::cout << "CHIP8: Sprite draw location out of bounds!\n";
-						break;
-					}
-
-					if(gfx[outputPixel])
-					{
-						V[0xF] = 1;
-						gfx[outputPixel] = 0;
-					}
-					else
-					{
-						gfx[outputPixel] = 1;
-					}
-				}
-			}
+			//	audioSource.Stop();
 		}
+	}
+}
 
-		drawFlag = true;
-		pc += 2;
+void Chip8Emu::Cycle()
+{
+	// Jit single steps, and Jit runs that can't use translated code, go through the decode cache
+	if (dispatch == Dispatch::Cached || dispatch == Dispatch::Jit)
+	{
+		// Fetch and decode only when the cached entry for this address is missing or stale
+		if ((decodedMask[pc >> 6] & (1ull << (pc & 63))) == 0)
+		{
+			decodeCache[pc] = Decode(static_cast<unsigned short>(memory[pc] << 8 | memory[pc + 1]));
+			decodedMask[pc >> 6] |= 1ull << (pc & 63);
+		}
+		const Instruction& in = decodeCache[pc];
+		opcode = in.opcode;
+		CHIP8_PROFILE_COUNT(pc, opcode, 1);
+		(this->*in.handler)(in);
+		return;
 	}
-	break;
 
-	case 0xE000:
-		switch (opcode & 0x00FF)
+	// Fetch opcode
+	opcode = static_cast<unsigned short>(memory[pc] << 8 | memory[pc + 1]);
+	CHIP8_PROFILE_COUNT(pc, opcode, 1);
+	//std::cout << "Current opcode: 0x" << std::hex << opcode << std::dec << std::endl;
+
+	// Decode and execute opcode
+	if (dispatch == Dispatch::Table)
+	{
+		// One load indexed by the high nibble and low byte picks the handler and the operands are split out
+		// in place, rather than building a complete decoded Instruction for every instruction run
+		Instruction in = DecodeOperands(opcode);
+		(this->*handlerTable[HandlerIndex(opcode)])(in);
+	}
+	else
+	{
+		Execute();
+	}
+}
+
+void Chip8Emu::Execute()
+{
+	Instruction in = DecodeOperands(opcode);
+
+	switch (opcode & 0xF000)
+	{
+	case 0x0000:
+		if (opcode == 0x00E0) // Clears screen
 		{
-		case 0x9E: // EX9E: Skips the next instruction if the key stored in VX is pressed.
-			if (key[V[(opcode & 0x0F00) >> 8]] != 0)
-			{
-				Log(opcode, "Skipping the next instruction because the key stored in VX is pressed.");
-				pc += 4;
-			}
-			else
-			{
-				Log(opcode, "Continuing to the next instruction because the key stored in VX is NOT pressed.");
-				pc += 2;
-			}
-			break;
+			Op00E0(in);
+		}
+		else if (opcode == 0x00EE) // Return from subroutine
+		{
+			Op00EE(in);
+		}
+		else
+		{
+			OpUnknown(in);
+		}
+		break;
 
-		case 0xA1: // EXA1: Skips the next instruction if the key stored in VX isn't pressed.
-			if (key[V[(opcode & 0x0F00) >> 8]] == 0)
-			{
-				Log(opcode, "Skipping the next instruction because the key stored in VX is NOT pressed.");
-				pc += 4;
-			}
-			else
-			{
-				Log(opcode, "Continuing to the next instruction because the key stored in VX is pressed.");
-				pc += 2;
-			}
-			break;
+	case 0x1000: Op1NNN(in); break;
+	case 0x2000: Op2NNN(in); break;
+	case 0x3000: Op3XNN(in); break;
+	case 0x4000: Op4XNN(in); break;
+	case 0x5000: Op5XY0(in); break;
+	case 0x6000: Op6XNN(in); break;
+	case 0x7000: Op7XNN(in); break;
 
-		default:
-			std::cout << "Unknown opcode: 0x" << std::hex << opcode << std::dec << std::endl;
-			break;
+	case 0x8000:
+		switch (opcode & 0x000F)
+		{
+		case 0x0: Op8XY0(in); break;
+		case 0x1: Op8XY1(in); break;
+		case 0x2: Op8XY2(in); break;
+		case 0x3: Op8XY3(in); break;
+		case 0x4: Op8XY4(in); break;
+		case 0x5: Op8XY5(in); break;
+		case 0x6: Op8XY6(in); break;
+		case 0x7: Op8XY7(in); break;
+		case 0xE: Op8XYE(in); break;
+		default: OpUnknown(in); break;
+		}
+		break;
+
+	case 0x9000: Op9XY0(in); break;
+	case 0xA000: OpANNN(in); break;
+	case 0xB000: OpBNNN(in); break;
+	case 0xC000: OpCXNN(in); break;
+	case 0xD000: OpDXYN(in); break;
+
+	case 0xE000:
+		switch (opcode & 0x00FF)
+		{
+		case 0x9E: OpEX9E(in); break;
+		case 0xA1: OpEXA1(in); break;
+		default: OpUnknown(in); break;
 		}
 		break;
 
 	case 0xF000:
-		int temp;
 		switch (opcode & 0x00FF)
 		{
-		case 0x07: // FX07: Sets VX to the value of the delay timer.
-			Log(opcode, "Set VX to the value of the delay timer");
-			V[(opcode & 0x0F00) >> 8] = delay_timer;
-			pc += 2;
-			break;
+		case 0x07: OpFX07(in); break;
+		case 0x0A: OpFX0A(in); break;
+		case 0x15: OpFX15(in); break;
+		case 0x18: OpFX18(in); break;
+		case 0x1E: OpFX1E(in); break;
+		case 0x29: OpFX29(in); break;
+		case 0x33: OpFX33(in); break;
+		case 0x55: OpFX55(in); break;
+		case 0x65: OpFX65(in); break;
+		default: OpUnknown(in); break;
+		}
+		break;
+	}
+}
 
-		case 0x0A: // FX0A: A key press is awaited, and then stored in VX.  STOPS EXECUTION (not including timers).
-			Log(opcode, "Waiting for key press, will store in VX");
-			for (unsigned char i = 0; i < 16; i++)
-			{
-				if (key[i] == 1)
-				{
-					V[(opcode & 0x0F00) >> 8] = i;
-					pc += 2;
-					break;
-				}
-			}
-			break;
+// Handler table, indexed by the high nibble and low byte of the opcode (see HandlerIndex).
+// Built at compile time so table dispatch is a single indexed load per instruction.
+constexpr Chip8Emu::HandlerTable Chip8Emu::BuildHandlerTable()
+{
+	HandlerTable table{};
+	for (OpHandler& handler : table)
+	{
+		handler = &Chip8Emu::OpUnknown;
+	}
 
-		case 0x15: // FX15: Sets the delay timer to VX.
-			Log(opcode, "Set the delay timer to VX");
-			delay_timer = V[(opcode & 0x0F00) >> 8];
-			pc += 2;
-			break;
+	table[0x0E0] = &Chip8Emu::Op00E0;
+	table[0x0EE] = &Chip8Emu::Op00EE;
 
-		case 0x18: // FX18: Sets the sound timer to VX.
-			Log(opcode, "Set the sound timer to VX");
-			sound_timer = V[(opcode & 0x0F00) >> 8];
-			pc += 2;
-			break;
+	constexpr OpHandler aluHandlers[16] =
+	{
+		&Chip8Emu::Op8XY0, &Chip8Emu::Op8XY1, &Chip8Emu::Op8XY2, &Chip8Emu::Op8XY3,
+		&Chip8Emu::Op8XY4, &Chip8Emu::Op8XY5, &Chip8Emu::Op8XY6, &Chip8Emu::Op8XY7,
+		&Chip8Emu::OpUnknown, &Chip8Emu::OpUnknown, &Chip8Emu::OpUnknown, &Chip8Emu::OpUnknown,
+		&Chip8Emu::OpUnknown, &Chip8Emu::OpUnknown, &Chip8Emu::Op8XYE, &Chip8Emu::OpUnknown
+	};
 
-		case 0x1E: // FX1E: Adds VX to I. VF is set to 1 if I+VX>0xFFF (Undocumented feature required by some games).
-			temp = V[(opcode & 0x0F00) >> 8] + I;
-			if (temp > 0xFFF) // Carry if exeeds I range
-			{
-				Log(opcode, "Added VX to I. VF is set to 1 because I+VX>0xFFF");
-				V[0xF] = 1;
-			}
-			else
-			{
-				Log(opcode, "Added VX to I. VF is set to 0 because I+VX<=0xFFF");
-				V[0xF] = 0;
-			}
-			I += static_cast<unsigned short>(V[(opcode & 0x0F00) >> 8]);
-			pc += 2;
-			break;
+	for (int low = 0; low < 256; low++)
+	{
+		table[0x100 | low] = &Chip8Emu::Op1NNN;
+		table[0x200 | low] = &Chip8Emu::Op2NNN;
+		table[0x300 | low] = &Chip8Emu::Op3XNN;
+		table[0x400 | low] = &Chip8Emu::Op4XNN;
+		table[0x500 | low] = &Chip8Emu::Op5XY0;
+		table[0x600 | low] = &Chip8Emu::Op6XNN;
+		table[0x700 | low] = &Chip8Emu::Op7XNN;
+		table[0x800 | low] = aluHandlers[low & 0xF];
+		table[0x900 | low] = &Chip8Emu::Op9XY0;
+		table[0xA00 | low] = &Chip8Emu::OpANNN;
+		table[0xB00 | low] = &Chip8Emu::OpBNNN;
+		table[0xC00 | low] = &Chip8Emu::OpCXNN;
+		table[0xD00 | low] = &Chip8Emu::OpDXYN;
+	}
 
-		case 0x29: // FX29: Sets I to the location of the sprite for the character in VX. Characters 0-F (in hexadecimal) are represented by a 4x5 font.
-			Log(opcode, "Set I to the location of the sprite for the character in VX");
-			I = static_cast<unsigned short>(V[(opcode & 0x0F00) >> 8] * 5);
-			pc += 2;
-			break;
+	table[0xE9E] = &Chip8Emu::OpEX9E;
+	table[0xEA1] = &Chip8Emu::OpEXA1;
 
-			// FX33: Stores the Binary-coded decimal representation of VX, with the most significant of three digits at the address in I,
-			// the middle digit at I plus 1, and the least significant digit at I plus 2. (In other words, take the decimal representation
-			// of VX, place the hundreds digit in memory at location in I, the tens digit at location I+1, and the ones digit at location I+2.)
-		case 0x33:
-			Log(opcode, "Stored binary-coded decimal at I, I+1, and I+2");
-			memory[I] =		V[(opcode & 0x0F00) >> 8] / 100;
-			memory[I + 1] = V[(opcode & 0x0F00) >> 8] / 10 % 10;
-			memory[I + 2] = V[(opcode & 0x0F00) >> 8] % 10;
-			pc += 2;
-			break;
+	table[0xF07] = &Chip8Emu::OpFX07;
+	table[0xF0A] = &Chip8Emu::OpFX0A;
+	table[0xF15] = &Chip8Emu::OpFX15;
+	table[0xF18] = &Chip8Emu::OpFX18;
+	table[0xF1E] = &Chip8Emu::OpFX1E;
+	table[0xF29] = &Chip8Emu::OpFX29;
+	table[0xF33] = &Chip8Emu::OpFX33;
+	table[0xF55] = &Chip8Emu::OpFX55;
+	table[0xF65] = &Chip8Emu::OpFX65;
 
-		case 0x55: // FX55: Stores V0 to VX in memory starting at address I.  I is unchanged.
-			Log(opcode, "Stored V0 to VX in memory starting at address I.");
-			for (int i = 0; i <= ((opcode & 0x0F00) >> 8); i++)
-			{
-				memory[I + i] = V[i];
-			}
-			pc += 2;
+	return table;
+}
+
+constexpr Chip8Emu::HandlerTable Chip8Emu::handlerTable = Chip8Emu::BuildHandlerTable();
+
+unsigned short Chip8Emu::HandlerIndex(unsigned short opcode)
+{
+	// 0NNN opcodes other than 00E0/00EE share their low byte with them, so route them to slot 0 (unknown)
+	if ((opcode & 0xFF00) != 0 && (opcode & 0xF000) == 0)
+	{
+		return 0;
+	}
+	return static_cast<unsigned short>((opcode & 0xF000) >> 4 | (opcode & 0x00FF));
+}
+
+Chip8Emu::Instruction Chip8Emu::DecodeOperands(unsigned short opcode)
+{
+	Instruction in;
+	in.handler = &Chip8Emu::OpUnknown;
+	in.opcode = opcode;
+	in.NNN = opcode & 0x0FFF;
+	in.NN = opcode & 0x00FF;
+	in.X = (opcode & 0x0F00) >> 8;
+	in.Y = (opcode & 0x00F0) >> 4;
+	in.N = opcode & 0x000F;
+	return in;
+}
+
+Chip8Emu::Instruction Chip8Emu::Decode(unsigned short opcode)
+{
+	Instruction in = DecodeOperands(opcode);
+	in.handler = handlerTable[HandlerIndex(opcode)];
+	return in;
+}
+
+// Allocates the code buffer on first use, false if translated code can't run in this build or on this system
+bool Chip8Emu::JitReady()
+{
+#ifdef CHIP8_JIT
+	if (!blockMemory.Data() && !jitUnavailable)
+	{
+		jitUnavailable = !blockMemory.Allocate(blockMemorySize);
+	}
+	return !jitUnavailable;
+#else
+	return false;
+#endif
+}
+
+#ifdef CHIP8_JIT
+// Sets pc past the next instruction if the flags satisfy skipIf, to the next instruction otherwise
+static void EmitSkip(Asm& out, unsigned short address, Asm::Condition skipIf)
+{
+	out.MovImm(Asm::R8, address + 2u);
+	out.MovImm(Asm::R9, address + 4u);
+	out.Cmovcc(skipIf, Asm::R8, Asm::R9);
+	out.StoreWord(StateField(offsetof(Chip8State, pc)), Asm::R8);
+}
+
+// VF = (minuend >= subtrahend), then VX = minuend - subtrahend, reading the operands again in case one of them was VF
+static void EmitSubtract(Asm& out, BlockRegisters& registers, unsigned int x, unsigned int minuend, unsigned int subtrahend)
+{
+	Asm::Reg left = registers.Read(out, minuend);
+	Asm::Reg right = registers.Read(out, subtrahend);
+	out.MovImm(Asm::RDX, 0);
+	out.Alu(Asm::Cmp, left, right);
+	out.Setcc(Asm::AboveOrEqual, Asm::RDX);
+	out.Mov(registers.Write(out, 0xF), Asm::RDX);
+
+	left = registers.Read(out, minuend);
+	right = registers.Read(out, subtrahend);
+	out.Mov(Asm::RAX, left);
+	out.Alu(Asm::Sub, Asm::RAX, right);
+	out.AluImm(Asm::And, Asm::RAX, 0xFF);
+	out.Mov(registers.Write(out, x), Asm::RAX);
+}
+#endif
+
+// Emits the code for one instruction at address, returns whether it ends the block (pc has then been set).
+// The handler Decode picks decides what's emitted, so every engine agrees on which opcodes exist. Flag results
+// are written before the result register, in the handlers' order, so VF as an operand behaves the same.
+bool Chip8Emu::TranslateInstruction(X64Emitter& out, BlockRegisters& registers, unsigned short address, unsigned short op)
+{
+#ifdef CHIP8_JIT
+	const Instruction in = Decode(op);
+	const OpHandler handler = in.handler;
+	const Asm::Mem pcField = StateField(offsetof(Chip8State, pc));
+	const Asm::Mem spField = StateField(offsetof(Chip8State, sp));
+	const unsigned int index = BlockRegisters::IndexSlot;
+
+	if (handler == &Chip8Emu::Op00EE)
+	{
+		out.LoadByte(Asm::RAX, spField);
+		out.AluImm(Asm::Sub, Asm::RAX, 1);
+		out.AluImm(Asm::And, Asm::RAX, 0xF);
+		out.StoreByte(spField, Asm::RAX);
+		out.LoadWord(Asm::RCX, StateField(offsetof(Chip8State, stack), Asm::RAX, 2));
+		out.AluImm(Asm::Add, Asm::RCX, 2);
+		out.StoreWord(pcField, Asm::RCX);
+		return true;
+	}
+	if (handler == &Chip8Emu::Op1NNN)
+	{
+		out.StoreWordImm(pcField, in.NNN);
+		return true;
+	}
+	if (handler == &Chip8Emu::Op2NNN)
+	{
+		out.LoadByte(Asm::RAX, spField);
+		out.StoreWordImm(StateField(offsetof(Chip8State, stack), Asm::RAX, 2), address);
+		out.AluImm(Asm::Add, Asm::RAX, 1);
+		out.AluImm(Asm::And, Asm::RAX, 0xF);
+		out.StoreByte(spField, Asm::RAX);
+		out.StoreWordImm(pcField, in.NNN);
+		return true;
+	}
+	if (handler == &Chip8Emu::Op3XNN || handler == &Chip8Emu::Op4XNN)
+	{
+		out.AluImm(Asm::Cmp, registers.Read(out, in.X), in.NN);
+		EmitSkip(out, address, handler == &Chip8Emu::Op3XNN ? Asm::Equal : Asm::NotEqual);
+		return true;
+	}
+	if (handler == &Chip8Emu::Op5XY0 || handler == &Chip8Emu::Op9XY0)
+	{
+		Asm::Reg vx = registers.Read(out, in.X);
+		Asm::Reg vy = registers.Read(out, in.Y);
+		out.Alu(Asm::Cmp, vx, vy);
+		EmitSkip(out, address, handler == &Chip8Emu::Op5XY0 ? Asm::Equal : Asm::NotEqual);
+		return true;
+	}
+	if (handler == &Chip8Emu::Op6XNN)
+	{
+		out.MovImm(registers.Write(out, in.X), in.NN);
+		return false;
+	}
+	if (handler == &Chip8Emu::Op7XNN)
+	{
+		Asm::Reg vx = registers.Modify(out, in.X);
+		out.AluImm(Asm::Add, vx, in.NN);
+		out.AluImm(Asm::And, vx, 0xFF);
+		return false;
+	}
+	if (handler == &Chip8Emu::Op8XY0)
+	{
+		Asm::Reg vy = registers.Read(out, in.Y);
+		out.Mov(registers.Write(out, in.X), vy);
+		return false;
+	}
+	if (handler == &Chip8Emu::Op8XY1 || handler == &Chip8Emu::Op8XY2 || handler == &Chip8Emu::Op8XY3)
+	{
+		Asm::Reg vy = registers.Read(out, in.Y);
+		Asm::Reg vx = registers.Modify(out, in.X);
+		out.Alu(handler == &Chip8Emu::Op8XY1 ? Asm::Or : handler == &Chip8Emu::Op8XY2 ? Asm::And : Asm::Xor, vx, vy);
+		return false;
+	}
+	if (handler == &Chip8Emu::Op8XY4)
+	{
+		out.Mov(Asm::RAX, registers.Read(out, in.X));
+		out.Alu(Asm::Add, Asm::RAX, registers.Read(out, in.Y));
+		out.ShrImm(Asm::RAX, 8);
+		out.Mov(registers.Write(out, 0xF), Asm::RAX);
+		Asm::Reg vy = registers.Read(out, in.Y);
+		Asm::Reg vx = registers.Modify(out, in.X);
+		out.Alu(Asm::Add, vx, vy);
+		out.AluImm(Asm::And, vx, 0xFF);
+		return false;
+	}
+	if (handler == &Chip8Emu::Op8XY5 || handler == &Chip8Emu::Op8XY7)
+	{
+		bool reverse = handler == &Chip8Emu::Op8XY7;
+		EmitSubtract(out, registers, in.X, reverse ? in.Y : in.X, reverse ? in.X : in.Y);
+		return false;
+	}
+	if (handler == &Chip8Emu::Op8XY6 || handler == &Chip8Emu::Op8XYE)
+	{
+		bool right = handler == &Chip8Emu::Op8XY6;
+		out.Mov(Asm::RAX, registers.Read(out, in.X));
+		out.AluImm(Asm::And, Asm::RAX, right ? 0x01 : 0x80);
+		out.Mov(registers.Write(out, 0xF), Asm::RAX);
+		Asm::Reg vx = registers.Modify(out, in.X);
+		if (right)
+		{
+			out.ShrImm(vx, 1);
+		}
+		else
+		{
+			out.ShlImm(vx, 1);
+			out.AluImm(Asm::And, vx, 0xFF);
+		}
+		return false;
+	}
+	if (handler == &Chip8Emu::OpANNN)
+	{
+		out.MovImm(registers.Write(out, index), in.NNN);
+		return false;
+	}
+	if (handler == &Chip8Emu::OpBNNN)
+	{
+		out.Mov(Asm::RAX, registers.Read(out, 0));
+		out.AluImm(Asm::Add, Asm::RAX, in.NNN);
+		out.StoreWord(pcField, Asm::RAX);
+		return true;
+	}
+	if (handler == &Chip8Emu::OpEX9E || handler == &Chip8Emu::OpEXA1)
+	{
+		out.Mov(Asm::RCX, registers.Read(out, in.X));
+		out.LoadWord(Asm::RAX, StateField(offsetof(Chip8State, keys)));
+		out.AluImm(Asm::And, Asm::RCX, 0xF);
+		out.ShrCl(Asm::RAX);
+		out.AluImm(Asm::And, Asm::RAX, 1);
+		EmitSkip(out, address, handler == &Chip8Emu::OpEX9E ? Asm::NotEqual : Asm::Equal);
+		return true;
+	}
+	if (handler == &Chip8Emu::OpFX07)
+	{
+		out.LoadByte(registers.Write(out, in.X), StateField(offsetof(Chip8State, delay_timer)));
+		return false;
+	}
+	if (handler == &Chip8Emu::OpFX15 || handler == &Chip8Emu::OpFX18)
+	{
+		out.StoreByte(StateField(handler == &Chip8Emu::OpFX15 ? offsetof(Chip8State, delay_timer) : offsetof(Chip8State, sound_timer)),
+			registers.Read(out, in.X));
+		return false;
+	}
+	if (handler == &Chip8Emu::OpFX1E)
+	{
+		out.Mov(Asm::RAX, registers.Read(out, in.X));
+		out.Alu(Asm::Add, Asm::RAX, registers.Read(out, index));
+		out.MovImm(Asm::RDX, 0);
+		out.AluImm(Asm::Cmp, Asm::RAX, 0xFFF);
+		out.Setcc(Asm::Above, Asm::RDX);
+		out.Mov(registers.Write(out, 0xF), Asm::RDX);
+		Asm::Reg vx = registers.Read(out, in.X);
+		Asm::Reg i = registers.Modify(out, index);
+		out.Alu(Asm::Add, i, vx);
+		out.AluImm(Asm::And, i, 0xFFFF);
+		return false;
+	}
+	if (handler == &Chip8Emu::OpFX29)
+	{
+		Asm::Reg vx = registers.Read(out, in.X);
+		out.ImulImm(registers.Write(out, index), vx, 5);
+		return false;
+	}
+	if (handler == &Chip8Emu::OpFX65)
+	{
+		// I goes to a scratch register first, loading V0-VX may evict it
+		out.Mov(Asm::RAX, registers.Read(out, index));
+		for (unsigned int i = 0; i <= in.X; i++)
+		{
+			out.LoadByte(registers.Write(out, i), StateField(offsetof(Chip8State, memory) + i, Asm::RAX));
+		}
+		return false;
+	}
+
+	// Everything else (00E0, CXNN, DXYN, FX0A, FX33, FX55) calls its handler, which advances the stored pc.
+	// Apart from CXNN these draw, wait or write memory, so the block ends with pc as the handler left it.
+	// The handler works on the registers in memory, and the call clobbers R10 and R11.
+	registers.Spill(out);
+	out.StoreWordImm(pcField, address);
+	out.Mov64(argumentRegisters[0], Asm::RBP);
+	out.MovImm(argumentRegisters[1], op);
+	out.MovImm64(Asm::RAX, reinterpret_cast<uintptr_t>(&Chip8Emu::CallHandler));
+	out.CallIndirect(Asm::RAX);
+	return handler != &Chip8Emu::OpCXNN;
+#else
+	(void)out;
+	(void)registers;
+	(void)address;
+	(void)op;
+	return true;
+#endif
+}
+
+// Translates the basic block starting at address, returns its index or -1 if it has to be interpreted
+int Chip8Emu::TranslateBlock(unsigned short address)
+{
+#ifdef CHIP8_JIT
+	const unsigned int maxBlockLength = 64;
+	const size_t maxBlockBytes = 16 * 1024; // Well above 64 of the longest translation (FX65 with X = F)
+
+	// Unknown opcodes are left to the interpreter, which reports them
+	if (jitUnavailable || address + 1 >= 4096 || Decode(static_cast<unsigned short>(memory[address] << 8 | memory[address + 1])).handler == &Chip8Emu::OpUnknown)
+	{
+		return -1;
+	}
+
+	// When the buffer is full everything is retranslated, rather than tracking which blocks are still in use
+	if (blockMemory.Size() - blockMemoryUsed < maxBlockBytes)
+	{
+		FlushBlocks();
+	}
+	if (!blockMemory.Unlock())
+	{
+		FlushBlocks();
+		jitUnavailable = true;
+		return -1;
+	}
+
+	// The body is translated first and the prologue put right in front of it afterwards, once it's known which
+	// callee-saved registers the cached guest registers ended up in
+	const size_t prologueSpace = 32;
+	unsigned char* start = blockMemory.Data() + blockMemoryUsed;
+	X64Emitter out(start + prologueSpace, maxBlockBytes - prologueSpace);
+
+	Block block = { nullptr, 0, 0, false };
+	BlockRegisters registers;
+	unsigned int a = address;
+	bool ended = false;
+	while (!ended && a + 1 < 4096 && block.count < maxBlockLength)
+	{
+		unsigned short op = static_cast<unsigned short>(memory[a] << 8 | memory[a + 1]);
+		OpHandler handler = Decode(op).handler;
+		if (handler == &Chip8Emu::OpUnknown)
+		{
 			break;
+		}
+
+		ended = TranslateInstruction(out, registers, static_cast<unsigned short>(a), op);
+		block.timed = block.timed || handler == &Chip8Emu::OpFX07 || handler == &Chip8Emu::OpFX15 || handler == &Chip8Emu::OpFX18
+			|| handler == &Chip8Emu::OpEX9E || handler == &Chip8Emu::OpEXA1 || handler == &Chip8Emu::OpFX0A;
+		block.count++;
+		block.lastOpcode = op;
+		blockCodeMask[a >> 6] |= 1ull << (a & 63);
+		blockCodeMask[(a + 1) >> 6] |= 1ull << ((a + 1) & 63);
+		a += 2;
+	}
+	if (!ended)
+	{
+		out.StoreWordImm(StateField(offsetof(Chip8State, pc)), static_cast<uint16_t>(a));
+	}
+	registers.Spill(out);
+
+	// RBX and RBP hold the state and the emulator for the whole block, R12-R15 any cached guest registers the
+	// block needed beyond R10 and R11. The frame keeps calls 16-byte aligned and gives the Windows x64 convention
+	// its 32 byte home area.
+	Asm::Reg preserved[6] = { Asm::RBX, Asm::RBP };
+	int preservedCount = 2;
+	for (Asm::Reg reg : { Asm::R12, Asm::R13, Asm::R14, Asm::R15 })
+	{
+		if (registers.Used(reg))
+		{
+			preserved[preservedCount++] = reg;
+		}
+	}
+	const int frameSize = preservedCount % 2 == 0 ? 40 : 32;
 
-		case 0x65: // FX65: Fills V0 to VX with values from memory starting at address I.  I is unchanged.
-			Log(opcode, "Filled V0 to VX with values from memory starting at address I.");
-			for (int i = 0; i <= ((opcode & 0x0F00) >> 8); i++)
+	out.AluImm64(Asm::Add, Asm::RSP, frameSize);
+	for (int i = preservedCount - 1; i >= 0; i--)
+	{
+		out.Pop(preserved[i]);
+	}
+	out.Ret();
+
+	unsigned char prologue[prologueSpace];
+	X64Emitter entry(prologue, sizeof(prologue));
+	for (int i = 0; i < preservedCount; i++)
+	{
+		entry.Push(preserved[i]);
+	}
+	entry.AluImm64(Asm::Sub, Asm::RSP, frameSize);
+	entry.Mov64(Asm::RBX, argumentRegisters[0]);
+	entry.Mov64(Asm::RBP, argumentRegisters[1]);
+	unsigned char* code = start + prologueSpace - entry.Size();
+	std::memcpy(code, prologue, entry.Size());
+	block.code = reinterpret_cast<BlockCode>(code);
+
+	if (!blockMemory.Lock())
+	{
+		FlushBlocks();
+		jitUnavailable = true;
+		return -1;
+	}
+	if (out.Overflowed())
+	{
+		return -1;
+	}
+
+	blockMemoryUsed += (prologueSpace + out.Size() + 15) & ~static_cast<size_t>(15); // Each block's space starts 16-byte aligned
+	blocks.push_back(block);
+	blockAt[address] = static_cast<int>(blocks.size() - 1);
+	return blockAt[address];
+#else
+	(void)address;
+	return -1;
+#endif
+}
+
+void Chip8Emu::FlushBlocks()
+{
+	blocks.clear();
+	blockAt.assign(4096, -1);
+	std::fill(std::begin(blockCodeMask), std::end(blockCodeMask), 0);
+	blockMemoryUsed = 0;
+	blocksStale = false;
+}
+
+// Runs one instruction for translated code through its handler. pc has been stored, the handler advances it.
+// Translated blocks have no unwind information, so nothing called from here may throw.
+void Chip8Emu::CallHandler(Chip8Emu* emu, unsigned int opcode)
+{
+	Instruction in = Decode(static_cast<unsigned short>(opcode));
+	emu->opcode = in.opcode;
+	(emu->*in.handler)(in);
+}
+
+// Runs translated blocks until at least count instructions have run. A block that neither touches the timers nor
+// reads the keypad may finish past count, up to limit: whether it runs before or after the timer tick or key change
+// due at count makes no difference to anything it does.
+int Chip8Emu::RunBlocks(int count, int limit, RunEvent event, bool& raised)
+{
+	unsigned int drawsBefore = drawCount;
+	bool stopOnDraw = event == RunEvent::Draw;
+
+	int executed = 0;
+	while (executed < count)
+	{
+		if (blocksStale)
+		{
+			FlushBlocks();
+		}
+
+		int index = pc < 4096 ? blockAt[pc] : -1;
+		if (index < 0)
+		{
+			index = TranslateBlock(pc);
+		}
+
+		if (index >= 0 && static_cast<int>(blocks[index].count) <= (blocks[index].timed ? count : limit) - executed)
+		{
+			const Block& block = blocks[index];
+#ifdef CHIP8_PROFILE
+			for (unsigned int i = 0; i < block.count; i++)
 			{
-				V[i] = memory[I + i];
+				unsigned int address = pc + i * 2;
+				CHIP8_PROFILE_COUNT(address, static_cast<unsigned short>(memory[address] << 8 | memory[address + 1]), 1);
 			}
-			pc += 2;
-			break;
+#endif
+			block.code(this, this);
+			opcode = block.lastOpcode;
+			executed += block.count;
+		}
+		else
+		{
+			// Untranslatable code, and blocks that don't fit in what's left of the budget, run one instruction at a time
+			Cycle();
+			executed++;
+		}
 
-		default:
-			std::cout << "Unknown opcode: 0x" << std::hex << opcode << std::dec << std::endl;
+		// Only the last instruction of a block can draw
+		if (stopOnDraw && drawCount != drawsBefore)
+		{
+			raised = true;
 			break;
 		}
-		break;
+	}
+	return executed;
+}
+
+void Chip8Emu::OpUnknown(const Instruction& in)
+{
+	std::cout << "Unknown opcode: 0x" << std::hex << in.opcode << std::dec << std::endl;
+}
+
+void Chip8Emu::Op00E0(const Instruction&) // 00E0: Clears screen
+{
+	CHIP8_LOG("Clear screen");
+	std::fill(std::begin(gfxRows), std::end(gfxRows), 0);
+	drawFlag = true;
+	drawCount++;
+	pc += 2;
+}
+
+void Chip8Emu::Op00EE(const Instruction&) // 00EE: Return from subroutine
+{
+	CHIP8_LOG("Return from subroutine");
+	sp = (sp - 1) & 0xF; // The 16 entry stack wraps rather than running off either end
+	pc = stack[sp];
+	pc += 2;
+}
 
+void Chip8Emu::Op1NNN(const Instruction& in) // 1NNN: Jump to NNN
+{
+	CHIP8_LOG("Jumped to " << in.NNN);
+	pc = in.NNN;
+}
+
+void Chip8Emu::Op2NNN(const Instruction& in) // 2NNN: Call subroutine at NNN
+{
+	CHIP8_LOG("Called subroutine at " << in.NNN);
+	stack[sp] = pc;
+	sp = (sp + 1) & 0xF;
+	pc = in.NNN;
+}
+
+void Chip8Emu::Op3XNN(const Instruction& in) // 3XNN: Skips the next instruction if VX equals NN.
+{
+	if (V[in.X] == in.NN)
+	{
+		CHIP8_LOG("Skipped next instruction (V" << static_cast<int>(in.X) << " == " << in.NN << ")");
+		pc += 4;
+	}
+	else
+	{
+		CHIP8_LOG("Continue to next instruction (V" << static_cast<int>(in.X) << " != " << in.NN << ")");
+		pc += 2;
+	}
+}
+
+void Chip8Emu::Op4XNN(const Instruction& in) // 4XNN: Skips the next instruction if VX doesn't equal NN.
+{
+	if (V[in.X] != in.NN)
+	{
+		CHIP8_LOG("Skipped next instruction (V" << static_cast<int>(in.X) << " != " << in.NN << ")");
+		pc += 4;
+	}
+	else
+	{
+		CHIP8_LOG("Continue to next instruction (V" << static_cast<int>(in.X) << " == " << in.NN << ")");
+		pc += 2;
+	}
+}
+
+void Chip8Emu::Op5XY0(const Instruction& in) // 5XY0: Skips the next instruction if VX equals VY.
+{
+	if (V[in.X] == V[in.Y])
+	{
+		CHIP8_LOG("Skipped next instruction (V" << static_cast<int>(in.X) << " == V" << static_cast<int>(in.Y) << ")");
+		pc += 4;
+	}
+	else
+	{
+		CHIP8_LOG("Continue to next instruction (V" << static_cast<int>(in.X) << " != V" << static_cast<int>(in.Y) << ")");
+		pc += 2;
+	}
+}
+
+void Chip8Emu::Op6XNN(const Instruction& in) // 6XNN: Sets VX to NN.
+{
+	CHIP8_LOG("Set V" << static_cast<int>(in.X) << " to " << in.NN);
+	V[in.X] = static_cast<unsigned char>(in.NN);
+	pc += 2;
+}
+
+void Chip8Emu::Op7XNN(const Instruction& in) // 7XNN: Adds NN to VX.
+{
+	CHIP8_LOG("Added " << in.NN << " to V" << static_cast<int>(in.X));
+	V[in.X] += static_cast<unsigned char>(in.NN);
+	pc += 2;
+}
+
+void Chip8Emu::Op8XY0(const Instruction& in) // 8XY0: Sets VX to the value of VY.
+{
+	CHIP8_LOG("Set V" << static_cast<int>(in.X) << " to the value of V" << static_cast<int>(in.Y));
+	V[in.X] = V[in.Y];
+	pc += 2;
+}
+
+void Chip8Emu::Op8XY1(const Instruction& in) // 8XY1: Sets VX to VX | VY.
+{
+	CHIP8_LOG("Set V" << static_cast<int>(in.X) << " to V" << static_cast<int>(in.X) << " | V" << static_cast<int>(in.Y));
+	V[in.X] |= V[in.Y];
+	pc += 2;
+}
+
+void Chip8Emu::Op8XY2(const Instruction& in) // 8XY2: Sets VX to VX & VY.
+{
+	CHIP8_LOG("Set V" << static_cast<int>(in.X) << " to V" << static_cast<int>(in.X) << " & V" << static_cast<int>(in.Y));
+	V[in.X] &= V[in.Y];
+	pc += 2;
+}
+
+void Chip8Emu::Op8XY3(const Instruction& in) // 8XY3: Sets VX to VX xor VY.
+{
+	CHIP8_LOG("Set V" << static_cast<int>(in.X) << " to V" << static_cast<int>(in.X) << " xor V" << static_cast<int>(in.Y));
+	V[in.X] ^= V[in.Y];
+	pc += 2;
+}
+
+void Chip8Emu::Op8XY4(const Instruction& in) // 8XY4: Adds VY to VX. VF is set to 1 when there's a carry, and to 0 when there isn't.
+{
+	int temp = V[in.X] + V[in.Y];
+	if (temp > 0xFF) // Carry if exeeds byte
+	{
+		CHIP8_LOG("Added V" << static_cast<int>(in.Y) << " to V" << static_cast<int>(in.X) << ". Carry, VF will be set to 1.");
+		V[0xF] = 1;
+	}
+	else
+	{
+		CHIP8_LOG("Added V" << static_cast<int>(in.Y) << " to V" << static_cast<int>(in.X) << ". No carry, VF will be set to 0.");
+		V[0xF] = 0;
+	}
+	V[in.X] += V[in.Y];
+	pc += 2;
+}
+
+void Chip8Emu::Op8XY5(const Instruction& in) // 8XY5: VY is subtracted from VX. VF is set to 0 when there's a borrow, and 1 when there isn't.
+{
+	int temp = V[in.X] - V[in.Y];
+	if (temp < 0) // Don't carry if borrow in subtract
+	{
+		CHIP8_LOG("Subtracted V" << static_cast<int>(in.Y) << " from V" << static_cast<int>(in.X) << ". Borrow, VF will be set to 0.");
+		V[0xF] = 0;
+	}
+	else
+	{
+		CHIP8_LOG("Subtracted V" << static_cast<int>(in.Y) << " from V" << static_cast<int>(in.X) << ". No borrow, VF will be set to 1.");
+		V[0xF] = 1;
+	}
+	V[in.X] -= V[in.Y];
+	pc += 2;
+}
+
+void Chip8Emu::Op8XY6(const Instruction& in) // 8XY6: Shifts VX right by one. VF is set to the value of the least significant bit of VX before the shift.
+{
+	CHIP8_LOG("Bit shifted V" << static_cast<int>(in.X) << " right by one. VF now contains least significant bit.");
+	V[0xF] = (V[in.X] & 0x1);
+	V[in.X] = (V[in.X] >> 1);
+	pc += 2;
+}
+
+void Chip8Emu::Op8XY7(const Instruction& in) // 8XY7: Sets VX to VY minus VX. VF is set to 0 when there's a borrow, and 1 when there isn't.
+{
+	int temp = V[in.Y] - V[in.X];
+	if (temp < 0) // Don't carry if borrow in subtract
+	{
+		CHIP8_LOG("Set V" << static_cast<int>(in.X) << " to V" << static_cast<int>(in.Y) << " minus V" << in.X << " Borrow, VF will be set to 0.");
+		V[0xF] = 0;
+	}
+	else
+	{
+		CHIP8_LOG("Set V" << static_cast<int>(in.X) << " to V" << static_cast<int>(in.Y) << " minus V" << in.X << " No borrow, VF will be set to 1.");
+		V[0xF] = 1;
+	}
+	V[in.X] = V[in.Y] - V[in.X];
+	pc += 2;
+}
+
+void Chip8Emu::Op8XYE(const Instruction& in) // 8XYE: Shifts VX left by one. VF is set to the value of the most significant bit of VX before the shift. // TODO: Questionable VF logic?
+{
+	CHIP8_LOG("Bit shifted V" << static_cast<int>(in.X) << " left by one. VF now contains most significant bit.");
+	V[0xF] = V[in.X] & 0x80;
+	V[in.X] = V[in.X] << 1;
+	pc += 2;
+}
+
+void Chip8Emu::Op9XY0(const Instruction& in) // 9XY0: Skips the next instruction if VX doesn't equal VY.
+{
+	if (V[in.X] != V[in.Y])
+	{
+		CHIP8_LOG("Skipped next instruction (V" << static_cast<int>(in.X) << " != V" << static_cast<int>(in.Y) << ")");
+		pc += 4;
+	}
+	else
+	{
+		CHIP8_LOG("Continue to next instruction (V" << static_cast<int>(in.X) << " == V" << static_cast<int>(in.Y) << ")");
+		pc += 2;
+	}
+}
+
+void Chip8Emu::OpANNN(const Instruction& in) // ANNN: Sets I to the address NNN
+{
+	CHIP8_LOG("Set I to the address " << in.NNN);
+	I = in.NNN;
+	pc += 2;
+}
+
+void Chip8Emu::OpBNNN(const Instruction& in) // BNNN: Jumps to the address NNN plus V0.
+{
+	CHIP8_LOG("Jump to the address " << in.NNN << " plus V0");
+	pc = V[0] + in.NNN;
+}
+
+void Chip8Emu::OpCXNN(const Instruction& in) // CXNN: Sets VX to the result of a bitwise and operation on a random number and NN.
+{
+	CHIP8_LOG("Set VX to the result of a bitwise and operation on a random number and NN.");
+	V[in.X] = static_cast<unsigned char>(in.NN & NextRandom());
+	pc += 2;
+}
+
+void Chip8Emu::OpDXYN(const Instruction& in) // DXYN: Draw sprite at location VX,VY on screen. Sprite is N lines high.
+{
+	// The start position wraps around the screen, the sprite itself is clipped at the edges
+	unsigned int x = V[in.X] % 64;
+	unsigned int y = V[in.Y] % 32;
+
+	CHIP8_LOG("Draw sprite at location V" << static_cast<int>(in.X) << ",V" << static_cast<int>(in.Y) << " (" << std::dec << x << "," << y << std::hex << ") on screen. Sprite is " << static_cast<int>(in.N) << " lines high.");
+
+	// Each sprite row is one byte, shifted into place and XORed onto the display row in one go
+	V[0xF] = 0;
+	for (unsigned int yline = 0; yline < in.N && y + yline < 32; yline++)
+	{
+		uint64_t spriteMask = static_cast<uint64_t>(memory[I + yline]) << 56 >> x;
+		if ((gfxRows[y + yline] & spriteMask) != 0)
+		{
+			V[0xF] = 1;
+		}
+		gfxRows[y + yline] ^= spriteMask;
+	}
+
+	drawFlag = true;
+	drawCount++;
+	pc += 2;
+}
+
+void Chip8Emu::OpEX9E(const Instruction& in) // EX9E: Skips the next instruction if the key stored in VX is pressed.
+{
+	if (keys >> (V[in.X] & 0xF) & 1)
+	{
+		CHIP8_LOG("Skipping the next instruction because the key stored in VX is pressed.");
+		pc += 4;
+	}
+	else
+	{
+		CHIP8_LOG("Continuing to the next instruction because the key stored in VX is NOT pressed.");
+		pc += 2;
+	}
+}
+
+void Chip8Emu::OpEXA1(const Instruction& in) // EXA1: Skips the next instruction if the key stored in VX isn't pressed.
+{
+	if ((keys >> (V[in.X] & 0xF) & 1) == 0)
+	{
+		CHIP8_LOG("Skipping the next instruction because the key stored in VX is NOT pressed.");
+		pc += 4;
+	}
+	else
+	{
+		CHIP8_LOG("Continuing to the next instruction because the key stored in VX is pressed.");
+		pc += 2;
+	}
+}
+
+void Chip8Emu::OpFX07(const Instruction& in) // FX07: Sets VX to the value of the delay timer.
+{
+	CHIP8_LOG("Set VX to the value of the delay timer");
+	V[in.X] = delay_timer;
+	pc += 2;
+}
+
+void Chip8Emu::OpFX0A(const Instruction& in) // FX0A: A key press is awaited, and then stored in VX.  STOPS EXECUTION (not including timers).
+{
+	CHIP8_LOG("Waiting for key press, will store in VX");
+	if (keys != 0)
+	{
+		unsigned char lowest = 0;
+		while ((keys >> lowest & 1) == 0)
+		{
+			lowest++;
+		}
+		V[in.X] = lowest;
+		pc += 2;
+	}
+}
+
+void Chip8Emu::OpFX15(const Instruction& in) // FX15: Sets the delay timer to VX.
+{
+	CHIP8_LOG("Set the delay timer to VX");
+	delay_timer = V[in.X];
+	pc += 2;
+}
+
+void Chip8Emu::OpFX18(const Instruction& in) // FX18: Sets the sound timer to VX.
+{
+	CHIP8_LOG("Set the sound timer to VX");
+	sound_timer = V[in.X];
+	pc += 2;
+}
+
+void Chip8Emu::OpFX1E(const Instruction& in) // FX1E: Adds VX to I. VF is set to 1 if I+VX>0xFFF (Undocumented feature required by some games).
+{
+	int temp = V[in.X] + I;
+	if (temp > 0xFFF) // Carry if exeeds I range
+	{
+		CHIP8_LOG("Added VX to I. VF is set to 1 because I+VX>0xFFF");
+		V[0xF] = 1;
+	}
+	else
+	{
+		CHIP8_LOG("Added VX to I. VF is set to 0 because I+VX<=0xFFF");
+		V[0xF] = 0;
+	}
+	I += static_cast<unsigned short>(V[in.X]);
+	pc += 2;
+}
+
+void Chip8Emu::OpFX29(const Instruction& in) // FX29: Sets I to the location of the sprite for the character in VX. Characters 0-F (in hexadecimal) are represented by a 4x5 font.
+{
+	CHIP8_LOG("Set I to the location of the sprite for the character in VX");
+	I = static_cast<unsigned short>(V[in.X] * 5);
+	pc += 2;
+}
+
+// FX33: Stores the Binary-coded decimal representation of VX, with the most significant of three digits at the address in I,
+// the middle digit at I plus 1, and the least significant digit at I plus 2. (In other words, take the decimal representation
+// of VX, place the hundreds digit in memory at location in I, the tens digit at location I+1, and the ones digit at location I+2.)
+void Chip8Emu::OpFX33(const Instruction& in)
+{
+	CHIP8_LOG("Stored binary-coded decimal at I, I+1, and I+2");
+	memory[I] =		V[in.X] / 100;
+	memory[I + 1] = V[in.X] / 10 % 10;
+	memory[I + 2] = V[in.X] % 10;
+	InvalidateDecoded(I, 3);
+	pc += 2;
+}
+
+void Chip8Emu::OpFX55(const Instruction& in) // FX55: Stores V0 to VX in memory starting at address I.  I is unchanged.
+{
+	CHIP8_LOG("Stored V0 to VX in memory starting at address I.");
+	for (int i = 0; i <= in.X; i++)
+	{
+		memory[I + i] = V[i];
+	}
+	InvalidateDecoded(I, in.X + 1);
+	pc += 2;
+}
+
+void Chip8Emu::OpFX65(const Instruction& in) // FX65: Fills V0 to VX with values from memory starting at address I.  I is unchanged.
+{
+	CHIP8_LOG("Filled V0 to VX with values from memory starting at address I.");
+	for (int i = 0; i <= in.X; i++)
+	{
+		V[i] = memory[I + i];
+	}
+	pc += 2;
+}
+
+bool Chip8Emu::GetPixel(int x, int y) const
+{
+	return (gfxRows[y] >> (63 - x) & 1) != 0;
+}
+
+uint64_t Chip8Emu::FrameHash() const
+{
+	return Chip8FrameHash(gfxRows);
+}
+
+void Chip8Emu::SaveState(Chip8State& state) const
+{
+	state = *this;
+}
+
+void Chip8Emu::LoadState(const Chip8State& state)
+{
+	static_cast<Chip8State&>(*this) = state;
+
+	// Decoded instructions describe the old memory. Blocks are flushed lazily, by the next RunBlocks.
+	std::fill(std::begin(decodedMask), std::end(decodedMask), 0);
+	blocksStale = !blocks.empty();
+
+	// The display may have changed, the presenter works out which rows by diffing against what it showed
+	drawFlag = true;
+}
+
+// Little-endian field-by-field writers, so the file doesn't depend on padding, struct layout or host byte order
+static void WriteBytes(std::ostream& out, const void* data, size_t size)
+{
+	out.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+}
+
+static void WriteInteger(std::ostream& out, uint64_t value, int size)
+{
+	unsigned char bytes[8];
+	for (int i = 0; i < size; i++)
+	{
+		bytes[i] = static_cast<unsigned char>(value >> (i * 8));
+	}
+	WriteBytes(out, bytes, size);
+}
+
+static uint64_t ReadInteger(std::istream& in, int size)
+{
+	unsigned char bytes[8] = {};
+	in.read(reinterpret_cast<char*>(bytes), size);
+	uint64_t value = 0;
+	for (int i = 0; i < size; i++)
+	{
+		value |= static_cast<uint64_t>(bytes[i]) << (i * 8);
+	}
+	return value;
+}
+
+// Layout: "C8ST", version (4 bytes), then the Chip8State fields in declaration order, integers little-endian
+void Chip8Emu::WriteState(std::ostream& out) const
+{
+	WriteBytes(out, "C8ST", 4);
+	WriteInteger(out, Chip8State::version, 4);
+
+	WriteBytes(out, memory, sizeof(memory));
+	for (uint64_t row : gfxRows)
+	{
+		WriteInteger(out, row, 8);
+	}
+	WriteBytes(out, V, sizeof(V));
+	WriteInteger(out, I, 2);
+	WriteInteger(out, pc, 2);
+	for (unsigned short entry : stack)
+	{
+		WriteInteger(out, entry, 2);
+	}
+	WriteInteger(out, sp, 1);
+	WriteInteger(out, delay_timer, 1);
+	WriteInteger(out, sound_timer, 1);
+	WriteInteger(out, keys, 2);
+	for (const KeyEvent& event : keyEvents)
+	{
+		WriteInteger(out, event.cycle, 8);
+		WriteInteger(out, event.keys, 2);
+	}
+	WriteInteger(out, keyEventCount, 1);
+	WriteInteger(out, rngState, 8);
+	WriteInteger(out, currentCycle, 8);
+	WriteInteger(out, timerAccumulator, 4);
+}
+
+// Reads a state written by WriteState and loads it, leaves the emulator untouched and returns false if it can't
+bool Chip8Emu::ReadState(std::istream& in)
+{
+	char magic[4];
+	in.read(magic, 4);
+	if (!in || std::memcmp(magic, "C8ST", 4) != 0 || ReadInteger(in, 4) != Chip8State::version)
+	{
+		return false;
+	}
+
+	Chip8State state;
+	in.read(reinterpret_cast<char*>(state.memory), sizeof(state.memory));
+	for (uint64_t& row : state.gfxRows)
+	{
+		row = ReadInteger(in, 8);
+	}
+	in.read(reinterpret_cast<char*>(state.V), sizeof(state.V));
+	state.I = static_cast<unsigned short>(ReadInteger(in, 2));
+	state.pc = static_cast<unsigned short>(ReadInteger(in, 2));
+	for (unsigned short& entry : state.stack)
+	{
+		entry = static_cast<unsigned short>(ReadInteger(in, 2));
+	}
+	state.sp = static_cast<unsigned char>(ReadInteger(in, 1) & 0xF);
+	state.delay_timer = static_cast<unsigned char>(ReadInteger(in, 1));
+	state.sound_timer = static_cast<unsigned char>(ReadInteger(in, 1));
+	state.keys = static_cast<unsigned short>(ReadInteger(in, 2));
+	for (KeyEvent& event : state.keyEvents)
+	{
+		event.cycle = ReadInteger(in, 8);
+		event.keys = static_cast<unsigned short>(ReadInteger(in, 2));
+	}
+	state.keyEventCount = static_cast<unsigned char>(ReadInteger(in, 1));
+	state.rngState = ReadInteger(in, 8);
+	state.currentCycle = ReadInteger(in, 8);
+	state.timerAccumulator = static_cast<unsigned int>(ReadInteger(in, 4));
+	if (!in || state.pc > 4096 - 2 || state.keyEventCount > sizeof(state.keyEvents) / sizeof(state.keyEvents[0]))
+	{
+		return false;
+	}
+
+	LoadState(state);
+	return true;
+}
+
+uint64_t Chip8Emu::GetRomHash() const
+{
+	return romHash;
+}
+
+uint64_t Chip8Emu::HashBytes(const void* data, size_t size)
+{
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	uint64_t hash = 0xCBF29CE484222325ull;
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 0x100000001B3ull;
+	}
+	return hash;
+}
+
+void Chip8Emu::PrintState(std::ostream& out) const
+{
+	std::ios::fmtflags flags = out.flags();
+	out << std::hex << std::uppercase << std::setfill('0');
+	for (int i = 0; i < 16; i++)
+	{
+		out << "V" << i << "=" << std::setw(2) << static_cast<int>(V[i]) << (i % 8 == 7 ? "\n" : " ");
+	}
+	out << "I=" << std::setw(3) << I << " PC=" << std::setw(3) << pc
+		<< " DT=" << std::setw(2) << static_cast<int>(delay_timer) << " ST=" << std::setw(2) << static_cast<int>(sound_timer)
+		<< " SP=" << std::dec << static_cast<int>(sp) << "\n";
+	out << "Cycles=" << currentCycle << "\n";
+	out.flags(flags);
+	out << std::setfill(' ');
+}
+
+#ifdef CHIP8_PROFILE
+// Instruction family of an opcode in the usual XYN notation, for the profile's opcode mix
+static const char* OpcodeFamily(unsigned short opcode)
+{
+	switch (opcode & 0xF000)
+	{
+	case 0x0000:
+		return opcode == 0x00E0 ? "00E0" : opcode == 0x00EE ? "00EE" : "unknown";
+	case 0x1000: return "1NNN";
+	case 0x2000: return "2NNN";
+	case 0x3000: return "3XNN";
+	case 0x4000: return "4XNN";
+	case 0x5000: return (opcode & 0xF) == 0 ? "5XY0" : "unknown";
+	case 0x6000: return "6XNN";
+	case 0x7000: return "7XNN";
+	case 0x8000:
+	{
+		static const char* const names[16] = { "8XY0", "8XY1", "8XY2", "8XY3", "8XY4", "8XY5", "8XY6", "8XY7",
+			"unknown", "unknown", "unknown", "unknown", "unknown", "unknown", "8XYE", "unknown" };
+		return names[opcode & 0xF];
+	}
+	case 0x9000: return (opcode & 0xF) == 0 ? "9XY0" : "unknown";
+	case 0xA000: return "ANNN";
+	case 0xB000: return "BNNN";
+	case 0xC000: return "CXNN";
+	case 0xD000: return "DXYN";
+	case 0xE000:
+		return (opcode & 0xFF) == 0x9E ? "EX9E" : (opcode & 0xFF) == 0xA1 ? "EXA1" : "unknown";
 	default:
-		std::cout << "Unknown opcode: 0x" << std::hex << opcode << std::dec << std::endl;
-		break;
+		switch (opcode & 0xFF)
+		{
+		case 0x07: return "FX07";
+		case 0x0A: return "FX0A";
+		case 0x15: return "FX15";
+		case 0x18: return "FX18";
+		case 0x1E: return "FX1E";
+		case 0x29: return "FX29";
+		case 0x33: return "FX33";
+		case 0x55: return "FX55";
+		case 0x65: return "FX65";
+		}
+		return "unknown";
 	}
 }
+#endif
+
+void Chip8Emu::PrintProfile(std::ostream& out, int hotAddresses) const
+{
+#ifdef CHIP8_PROFILE
+	unsigned long long total = 0;
+	std::vector<std::pair<unsigned long long, unsigned short>> addresses;
+	for (unsigned short address = 0; address < 4096; address++)
+	{
+		if (profileAddresses[address] > 0)
+		{
+			addresses.push_back({ profileAddresses[address], address });
+			total += profileAddresses[address];
+		}
+	}
+	std::sort(addresses.begin(), addresses.end(), [](const std::pair<unsigned long long, unsigned short>& a, const std::pair<unsigned long long, unsigned short>& b)
+		{
+			return a.first > b.first || (a.first == b.first && a.second < b.second);
+		});
+
+	// Handler table slots are reduced to their family, e.g. all 8XY4 slots are one row
+	std::map<std::string, unsigned long long> families;
+	for (unsigned short index = 0; index < 16 * 256; index++)
+	{
+		if (profileOpcodes[index] > 0)
+		{
+			unsigned short representative = static_cast<unsigned short>((index & 0xF00) << 4 | (index & 0xFF));
+			families[OpcodeFamily(representative)] += profileOpcodes[index];
+		}
+	}
+	std::vector<std::pair<unsigned long long, std::string>> mix;
+	for (const auto& family : families)
+	{
+		mix.push_back({ family.second, family.first });
+	}
+	std::sort(mix.begin(), mix.end(), [](const std::pair<unsigned long long, std::string>& a, const std::pair<unsigned long long, std::string>& b)
+		{
+			return a.first > b.first;
+		});
+
+	std::ios::fmtflags flags = out.flags();
+	std::streamsize precision = out.precision();
+	double percent = total > 0 ? 100.0 / total : 0.0;
+	out << "Instructions profiled: " << total << "\n";
+	out << "Hot addresses:\n";
+	for (size_t i = 0; i < addresses.size() && i < static_cast<size_t>(hotAddresses); i++)
+	{
+		unsigned short address = addresses[i].second;
+		unsigned short op = static_cast<unsigned short>(memory[address] << 8 | memory[(address + 1) & 0xFFF]);
+		out << "  " << std::hex << std::uppercase << std::setfill('0') << std::setw(3) << address << "  " << std::setw(4) << op
+			<< std::dec << std::setfill(' ') << std::setw(14) << addresses[i].first
+			<< std::fixed << std::setprecision(2) << std::setw(8) << addresses[i].first * percent << "%\n";
+	}
+	out << "Opcode mix:\n";
+	for (const auto& family : mix)
+	{
+		out << "  " << std::left << std::setw(8) << family.second << std::right << std::setw(14) << family.first
+			<< std::fixed << std::setprecision(2) << std::setw(8) << family.first * percent << "%\n";
+	}
+	out.flags(flags);
+	out.precision(precision);
+#else
+	(void)hotAddresses;
+	out << "Profiling is not compiled in, define CHIP8_PROFILE to enable it\n";
+#endif
+}
+
+void Chip8Emu::ResetProfile()
+{
+#ifdef CHIP8_PROFILE
+	std::fill(std::begin(profileOpcodes), std::end(profileOpcodes), 0);
+	std::fill(std::begin(profileAddresses), std::end(profileAddresses), 0);
+#endif
+}
 
 void Chip8Emu::Log(unsigned int opcode, std::string string)
 {
@@ -571,5 +1887,3 @@ void Chip8Emu::Log(unsigned int opcode, std::ostringstream &stringStream)
 	}
 	stringStream.str("");
 }
-
-
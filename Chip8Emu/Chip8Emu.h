@@ -1,64 +1,224 @@
 #pragma once
-#include <stack>
+#include "ExecutableMemory.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
 #include <string>
+#include <type_traits>
+#include <vector>
+
+// Opcode dispatch engines, selectable per instance. Table makes a call through the handler table for every
+// instruction, which costs more than Switch's inlined handlers, so it runs slower than Switch (about 15% on
+// Invaders.ch8). It's kept as the uncached form of Cached, not as a faster alternative.
+enum class Dispatch
+{
+	Switch, // Nested switch on the opcode nibbles (Execute)
+	Table,  // Compile-time handler table, indexed by the opcode's high nibble and low byte
+	Cached, // Table dispatch through a per-address decoded instruction cache
+	Jit     // Basic blocks compiled to x86-64 code with V0-VF and I held in host registers within a block,
+	        // runs as Cached on other targets or with debugFlag set
+};
+
+class X64Emitter;
+class BlockRegisters;
+
+// Events that can end a RunUntil call early
+enum class RunEvent
+{
+	NoEvent,
+	Draw // 00E0 or DXYN changed the display
+};
+
+// Keypad state from a given instruction count on, bit n is key n
+struct KeyEvent
+{
+	unsigned long long cycle;
+	unsigned short keys;
+};
 
-class Chip8Emu
+// Complete machine state. Trivially copyable, so saving or restoring a Chip8Emu is a single ~4.5 KB copy.
+// Caches, configuration and presentation flags live in Chip8Emu itself and are rebuilt or left alone on restore.
+struct Chip8State
+{
+	unsigned char memory[4096];
+	uint64_t gfxRows[32]; // Display, one 64 pixel row per element, leftmost pixel in the most significant bit
+	unsigned char V[16]; // Registers
+	unsigned short I; // Index register
+	unsigned short pc; // Program counter
+	unsigned short stack[16];
+	unsigned char sp; // Stack pointer, the next free stack entry
+	unsigned char delay_timer;
+	unsigned char sound_timer;
+	unsigned short keys; // Keypad input state, bit n is key n
+	KeyEvent keyEvents[16]; // Queued keypad changes, oldest first, applied just before the instruction at their cycle
+	unsigned char keyEventCount;
+	uint64_t rngState; // Per-instance CXNN generator, so instances are reproducible and share no lock
+	unsigned long long currentCycle;
+	unsigned int timerAccumulator; // 60 per instruction, a timer tick is due each time it reaches instructionsPerSecond
+
+	static const uint32_t version = 2; // Bumped whenever the serialized layout changes
+};
+
+static_assert(std::is_trivially_copyable<Chip8State>::value, "Chip8State must stay memcpy-able");
+
+class Chip8Emu : private Chip8State
 {
 public:
+	static const size_t MaxRomSize = 4096 - 0x200; // Everything from 0x200 to the end of memory
+
 	int debugFlag = 0;
+	Dispatch dispatch = Dispatch::Switch;
 	int cyclesPerUpdate = 1;
-	bool cycleUntilDraw = 1; // currently unimplemented
-	int cyclesPerTimerDecrement = 10;
-	bool gfx[64 * 32];
-	bool key[16]; // Keypad input state
-	unsigned char memory[4096];
+	bool cycleUntilDraw = 1; // Update() runs until the next 00E0/DXYN instead of cyclesPerUpdate cycles
+	int maxCyclesPerDraw = 1000; // Cycle budget for one cycleUntilDraw update, for ROMs that stop drawing
+	uint64_t rngSeed = 0; // CXNN random number seed, applied by Initialize and Seed
+	bool idleSkip = true; // Fast-forward through idle loops (jump to self, key waits, delay timer polls)
+	using Chip8State::gfxRows;
+	using Chip8State::memory;
 	bool drawFlag;
 
 private:
-	// Internals
+	// Internals, machine state is in Chip8State
 	unsigned short opcode;
-	unsigned char V[16]; // Registers
-	unsigned short I; // Index register
-	unsigned short pc; // Program counter
+	int instructionsPerSecond = 600; // Always at least 1, see SetInstructionsPerSecond
+	uint64_t romHash = 0; // HashBytes of the last loaded ROM file
+	unsigned int drawCount; // Display writes so far, lets RunUntil notice a draw without touching drawFlag
 
-	unsigned char delay_timer;
-	unsigned char sound_timer;
+	// Decoded instruction, operands are extracted once so handlers don't have to
+	struct Instruction;
+	typedef void (Chip8Emu::*OpHandler)(const Instruction& in);
+	struct Instruction
+	{
+		OpHandler handler;
+		unsigned short opcode;
+		unsigned short NNN;
+		unsigned short NN;
+		unsigned char X;
+		unsigned char Y;
+		unsigned char N;
+	};
 
-	unsigned int currentCycle;
+	// Handler per HandlerIndex slot, filled in at compile time by BuildHandlerTable.
+	typedef std::array<OpHandler, 16 * 256> HandlerTable;
+	static const HandlerTable handlerTable;
 
-	std::stack<unsigned short> stack; // may need to limit to 16 elements?
+	// Decoded instruction cache, one entry per address. A set bit in decodedMask marks a valid entry,
+	// writes to memory clear the bits of every entry that overlaps them.
+	std::vector<Instruction> decodeCache;
+	unsigned long long decodedMask[4096 / 64];
 
-	// Graphics
-	unsigned char chip8_fontset[5 * 16] =
+	// Basic blocks compiled to native code (Dispatch::Jit). A block runs from its start address up to and including
+	// the first instruction that can leave straight-line flow, draw, wait for a key or write memory.
+	typedef void (*BlockCode)(Chip8State* state, Chip8Emu* emu);
+	struct Block
 	{
-		0b11110000,
-		0b10010000,
-		0b10010000,
-		0b10010000,
-		0b11110000,
-		0x20, 0x60, 0x20, 0x20, 0x70, // 1
-		0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
-		0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
-		0x90, 0x90, 0xF0, 0x10, 0x10, // 4
-		0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
-		0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
-		0xF0, 0x10, 0x20, 0x40, 0x40, // 7
-		0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
-		0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
-		0xF0, 0x90, 0xF0, 0x90, 0x90, // A
-		0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
-		0xF0, 0x80, 0x80, 0x80, 0xF0, // C
-		0xE0, 0x90, 0x90, 0x90, 0xE0, // D
-		0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
-		0xF0, 0x80, 0xF0, 0x80, 0x80  // F
+		BlockCode code;
+		unsigned int count; // Instructions in the block
+		unsigned short lastOpcode;
+		bool timed; // Touches the timers or reads the keypad, so it can't run past a timer tick or key event
 	};
+	std::vector<Block> blocks;
+	std::vector<int> blockAt; // Block index per start address, -1 if untranslated
+	unsigned long long blockCodeMask[4096 / 64]; // Bytes covered by any translated block
+	bool blocksStale;
+	ExecutableMemory blockMemory; // Translated code, allocated by the first Jit run
+	size_t blockMemoryUsed = 0;
+	bool jitUnavailable = false; // Not an x86-64 build, or the system refused executable memory
+
+#ifdef CHIP8_PROFILE
+	// Execution counters, compiled in only when CHIP8_PROFILE is defined
+	unsigned long long profileOpcodes[16 * 256]; // Per handler table slot (HandlerIndex)
+	unsigned long long profileAddresses[4096]; // Per pc
+#endif
 
 public:
 	void Start();
 	void Initialize();
+	bool LoadRom(const char* filename);
+	bool LoadRom(const unsigned char* data, size_t size); // ROM image already in memory, e.g. from a RomPack
+	void InvalidateDecoded(unsigned int address, unsigned int length); // Call after writing to memory directly
 	void Update();
+	int RunCycles(int cycles);
+	int RunUntil(RunEvent event, int maxCycles);
+	int CyclesUntilTimerTick() const; // Next scheduled event, batch runners can run exactly this far
+	int CyclesUntilKeyEvent() const; // Next queued key change, INT_MAX if there is none
+	void SetInstructionsPerSecond(int ips); // Emulated CPU speed, at least 1. The timers tick at 60 Hz of emulated time.
+	int GetInstructionsPerSecond() const;
+	unsigned long long GetCycleCount() const;
+	unsigned short GetKeys() const;
+	void SetKeys(unsigned short mask); // Changes the keypad now, queued events still apply on top
+	bool QueueKeys(unsigned long long cycle, unsigned short mask, unsigned long long& applied); // False if the queue is full, else applied is the cycle it will apply at
+	void ClearKeyEvents();
+	void Seed(uint64_t seed);
 	void Cycle();
 	void Execute();
+	bool GetPixel(int x, int y) const;
+	uint64_t FrameHash() const;
+	uint64_t GetRomHash() const; // Identifies the loaded ROM, e.g. so a recorded movie can check it's replayed on the same one
+	static uint64_t HashBytes(const void* data, size_t size); // 64-bit FNV-1a
+	void SaveState(Chip8State& state) const;
+	void LoadState(const Chip8State& state);
+	void WriteState(std::ostream& out) const; // Versioned binary format, independent of struct layout and byte order
+	bool ReadState(std::istream& in);
+	void PrintState(std::ostream& out) const; // Registers, timers and cycle count, for headless runs and bug reports
+	void PrintProfile(std::ostream& out, int hotAddresses = 20) const; // Hot-address table and opcode mix (CHIP8_PROFILE builds)
+	void ResetProfile();
 	void Log(unsigned int opcode, std::string string);
 	void Log(unsigned int opcode, std::ostringstream& stringStream);
+
+private:
+	static constexpr HandlerTable BuildHandlerTable();
+	static unsigned short HandlerIndex(unsigned short opcode);
+	static Instruction DecodeOperands(unsigned short opcode);
+	static Instruction Decode(unsigned short opcode);
+	bool JitReady();
+	static bool TranslateInstruction(X64Emitter& out, BlockRegisters& registers, unsigned short address, unsigned short op);
+	int TranslateBlock(unsigned short address);
+	void FlushBlocks();
+	static void CallHandler(Chip8Emu* emu, unsigned int opcode); // Entry point for translated code
+	int RunInstructions(int count, int limit, RunEvent event, bool& raised);
+	int SkipIdle(int count);
+	int RunBlocks(int count, int limit, RunEvent event, bool& raised);
+	void ApplyKeyEvents(unsigned long long cycle);
+	void TickTimers();
+	unsigned char NextRandom();
+
+	// Opcode handlers, shared by both dispatch engines
+	void OpUnknown(const Instruction& in);
+	void Op00E0(const Instruction& in);
+	void Op00EE(const Instruction& in);
+	void Op1NNN(const Instruction& in);
+	void Op2NNN(const Instruction& in);
+	void Op3XNN(const Instruction& in);
+	void Op4XNN(const Instruction& in);
+	void Op5XY0(const Instruction& in);
+	void Op6XNN(const Instruction& in);
+	void Op7XNN(const Instruction& in);
+	void Op8XY0(const Instruction& in);
+	void Op8XY1(const Instruction& in);
+	void Op8XY2(const Instruction& in);
+	void Op8XY3(const Instruction& in);
+	void Op8XY4(const Instruction& in);
+	void Op8XY5(const Instruction& in);
+	void Op8XY6(const Instruction& in);
+	void Op8XY7(const Instruction& in);
+	void Op8XYE(const Instruction& in);
+	void Op9XY0(const Instruction& in);
+	void OpANNN(const Instruction& in);
+	void OpBNNN(const Instruction& in);
+	void OpCXNN(const Instruction& in);
+	void OpDXYN(const Instruction& in);
+	void OpEX9E(const Instruction& in);
+	void OpEXA1(const Instruction& in);
+	void OpFX07(const Instruction& in);
+	void OpFX0A(const Instruction& in);
+	void OpFX15(const Instruction& in);
+	void OpFX18(const Instruction& in);
+	void OpFX1E(const Instruction& in);
+	void OpFX29(const Instruction& in);
+	void OpFX33(const Instruction& in);
+	void OpFX55(const Instruction& in);
+	void OpFX65(const Instruction& in);
 };
\ No newline at end of file
@@ -0,0 +1,562 @@
+#include "Chip8Lockstep.h"
+#include "Chip8Common.h"
+#include "Chip8Emu.h"
+#include "MappedFile.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(CHIP8_LOCKSTEP_SIMD) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#ifdef CHIP8_LOCKSTEP_SIMD
+// CPUID feature flags, plus XCR0 to check the OS saves the wider registers across context switches
+static bool CpuSupports(LockstepEngine engine)
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+	{
+		return false;
+	}
+	__cpuid(info, 1);
+	bool osSavesState = (info[2] & (1 << 27)) != 0;
+	bool popcnt = (info[2] & (1 << 23)) != 0;
+	if (!osSavesState || !popcnt)
+	{
+		return false;
+	}
+	unsigned long long xcr0 = _xgetbv(0);
+	__cpuidex(info, 7, 0);
+	bool avx2 = (xcr0 & 0x06) == 0x06 && (info[1] & (1 << 5)) != 0;
+	if (engine == LockstepEngine::Avx2)
+	{
+		return avx2;
+	}
+	// AVX-512 F, BW and VL, with the mask and upper ZMM registers saved too
+	unsigned int avx512 = (1u << 16) | (1u << 30) | (1u << 31);
+	return avx2 && (xcr0 & 0xE6) == 0xE6 && (static_cast<unsigned int>(info[1]) & avx512) == avx512;
+#else
+	__builtin_cpu_init();
+	bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+	if (engine == LockstepEngine::Avx2)
+	{
+		return avx2;
+	}
+	return avx2 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl");
+#endif
+}
+#endif
+
+bool Chip8Lockstep::EngineSupported(LockstepEngine engine)
+{
+#ifdef CHIP8_LOCKSTEP_SIMD
+	static const bool avx2 = CpuSupports(LockstepEngine::Avx2);
+	static const bool avx512 = CpuSupports(LockstepEngine::Avx512);
+	switch (engine)
+	{
+	case LockstepEngine::Avx2: return avx2;
+	case LockstepEngine::Avx512: return avx512;
+	default: return true;
+	}
+#else
+	return engine == LockstepEngine::Scalar;
+#endif
+}
+
+LockstepEngine Chip8Lockstep::FastestEngine()
+{
+	for (LockstepEngine engine : { LockstepEngine::Avx512, LockstepEngine::Avx2 })
+	{
+		if (EngineSupported(engine))
+		{
+			return engine;
+		}
+	}
+	return LockstepEngine::Scalar;
+}
+
+void Chip8Lockstep::Start()
+{
+	std::memset(V, 0, sizeof(V));
+	std::memset(stack, 0, sizeof(stack));
+	std::memset(gfxRows, 0, sizeof(gfxRows));
+	std::memset(memory, 0, sizeof(memory));
+	std::memset(writtenMask, 0, sizeof(writtenMask));
+
+	for (int lane = 0; lane < Lanes; lane++)
+	{
+		I[lane] = 0;
+		pc[lane] = 0x200;
+		sp[lane] = 0;
+		delayTimer[lane] = 0;
+		soundTimer[lane] = 0;
+		timerAccumulator[lane] = 0;
+		keys[lane] = 0;
+		cycleCount[lane] = 0;
+		std::memcpy(memory[lane], chip8Fontset, sizeof(chip8Fontset));
+		Seed(lane, 0);
+	}
+
+	steps = 0;
+	laneSteps = 0;
+}
+
+bool Chip8Lockstep::LoadRom(const char* filename)
+{
+	MappedFile file;
+	return file.Open(filename) && LoadRom(file.Data(), file.Size());
+}
+
+// Same size limit as Chip8Emu::LoadRom, a ROM that doesn't fit is rejected rather than cut off
+bool Chip8Lockstep::LoadRom(const unsigned char* data, size_t size)
+{
+	if (size > Chip8Emu::MaxRomSize)
+	{
+		return false;
+	}
+
+	for (int lane = 0; lane < Lanes && size > 0; lane++)
+	{
+		std::memcpy(memory[lane] + 0x200, data, size);
+	}
+	return true;
+}
+
+// Same seeding and generator as Chip8Emu, so a lane and a Chip8Emu with the same seed draw the same numbers
+void Chip8Lockstep::Seed(int lane, uint64_t seed)
+{
+	rngState[lane] = Chip8RandomState(seed);
+}
+
+unsigned char Chip8Lockstep::NextRandom(int lane)
+{
+	return Chip8NextRandom(rngState[lane]);
+}
+
+void Chip8Lockstep::SetKeys(int lane, unsigned short laneKeys)
+{
+	keys[lane] = laneKeys;
+}
+
+void Chip8Lockstep::SetInstructionsPerSecond(int ips)
+{
+	instructionsPerSecond = std::max(1, ips);
+	for (unsigned int& accumulator : timerAccumulator)
+	{
+		accumulator %= static_cast<unsigned int>(instructionsPerSecond);
+	}
+}
+
+int Chip8Lockstep::GetInstructionsPerSecond() const
+{
+	return instructionsPerSecond;
+}
+
+uint64_t Chip8Lockstep::FrameHash(int lane) const
+{
+	uint64_t rows[32];
+	for (int row = 0; row < 32; row++)
+	{
+		rows[row] = gfxRows[row][lane];
+	}
+	return Chip8FrameHash(rows);
+}
+
+unsigned long long Chip8Lockstep::GetCycleCount(int lane) const
+{
+	return cycleCount[lane];
+}
+
+double Chip8Lockstep::LaneUtilization() const
+{
+	return steps > 0 ? static_cast<double>(laneSteps) / (static_cast<double>(steps) * Lanes) : 0.0;
+}
+
+unsigned short Chip8Lockstep::Fetch(int lane) const
+{
+	return static_cast<unsigned short>(memory[lane][pc[lane] & 0xFFF] << 8 | memory[lane][(pc[lane] + 1) & 0xFFF]);
+}
+
+void Chip8Lockstep::MarkWritten(unsigned int address, unsigned int length)
+{
+	for (unsigned int i = 0; i < length; i++)
+	{
+		unsigned int byte = (address + i) & 0xFFF;
+		writtenMask[byte >> 6] |= 1ull << (byte & 63);
+	}
+}
+
+// False if every lane still holds the same bytes from address to address + length - 1
+bool Chip8Lockstep::MayDiffer(unsigned int address, unsigned int length) const
+{
+	for (unsigned int i = 0; i < length; i++)
+	{
+		unsigned int byte = (address + i) & 0xFFF;
+		if ((writtenMask[byte >> 6] >> (byte & 63) & 1) != 0)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+void Chip8Lockstep::RunCycles(int cycles)
+{
+	switch (EngineSupported(engine) ? engine : LockstepEngine::Scalar)
+	{
+#ifdef CHIP8_LOCKSTEP_SIMD
+	case LockstepEngine::Avx2:
+		RunAvx2(cycles);
+		break;
+	case LockstepEngine::Avx512:
+		RunAvx512(cycles);
+		break;
+#endif
+	default:
+		RunScalar(cycles);
+		break;
+	}
+}
+
+void Chip8Lockstep::RunScalar(int cycles)
+{
+	int remaining[Lanes];
+	std::fill(std::begin(remaining), std::end(remaining), cycles);
+
+	for (;;)
+	{
+		// The lowest pc among lanes that still have cycles to run goes next
+		int leader = -1;
+		for (int lane = 0; lane < Lanes; lane++)
+		{
+			if (remaining[lane] > 0 && (leader < 0 || pc[lane] < pc[leader]))
+			{
+				leader = lane;
+			}
+		}
+		if (leader < 0)
+		{
+			break;
+		}
+
+		// Every lane at that pc with the same instruction there (memory may differ per lane) runs it together
+		unsigned short opcode = Fetch(leader);
+		bool active[Lanes];
+		int activeCount = 0;
+		for (int lane = 0; lane < Lanes; lane++)
+		{
+			active[lane] = remaining[lane] > 0 && pc[lane] == pc[leader] && Fetch(lane) == opcode;
+			activeCount += active[lane];
+		}
+
+		Execute(opcode, active);
+
+		// Per-lane 60 Hz timers, as in Chip8Emu::RunUntil
+		for (int lane = 0; lane < Lanes; lane++)
+		{
+			if (!active[lane])
+			{
+				continue;
+			}
+
+			remaining[lane]--;
+			cycleCount[lane]++;
+			timerAccumulator[lane] += 60;
+			while (timerAccumulator[lane] >= static_cast<unsigned int>(instructionsPerSecond))
+			{
+				timerAccumulator[lane] -= instructionsPerSecond;
+				if (delayTimer[lane] > 0)
+				{
+					delayTimer[lane]--;
+				}
+				if (soundTimer[lane] > 0)
+				{
+					soundTimer[lane]--;
+				}
+			}
+		}
+
+		steps++;
+		laneSteps += activeCount;
+	}
+}
+
+// Applies one instruction to every active lane. Flag and operand ordering follows the Chip8Emu handlers
+// exactly (VF is written before VX, so X or Y == F behaves the same).
+void Chip8Lockstep::Execute(unsigned short opcode, const bool active[Lanes])
+{
+	unsigned char X = (opcode & 0x0F00) >> 8;
+	unsigned char Y = (opcode & 0x00F0) >> 4;
+	unsigned char N = opcode & 0x000F;
+	unsigned char NN = opcode & 0x00FF;
+	unsigned short NNN = opcode & 0x0FFF;
+
+	unsigned char* VX = V[X];
+	unsigned char* VY = V[Y];
+	unsigned char* VF = V[0xF];
+
+	switch (opcode & 0xF000)
+	{
+	case 0x0000:
+		if (opcode == 0x00E0) // 00E0: Clears screen
+		{
+			for (int lane = 0; lane < Lanes; lane++)
+			{
+				if (active[lane])
+				{
+					for (uint64_t* row : gfxRows)
+					{
+						row[lane] = 0;
+					}
+					pc[lane] += 2;
+				}
+			}
+		}
+		else if (opcode == 0x00EE) // 00EE: Return from subroutine
+		{
+			for (int lane = 0; lane < Lanes; lane++)
+			{
+				if (active[lane])
+				{
+					sp[lane] = (sp[lane] - 1) & 0xF;
+					pc[lane] = stack[sp[lane]][lane] + 2;
+				}
+			}
+		}
+		// Unknown opcodes leave pc where it is, like Chip8Emu::OpUnknown (without the console message)
+		break;
+
+	case 0x1000: // 1NNN: Jump to NNN
+		for (int lane = 0; lane < Lanes; lane++)
+		{
+			pc[lane] = active[lane] ? NNN : pc[lane];
+		}
+		break;
+
+	case 0x2000: // 2NNN: Call subroutine at NNN
+		for (int lane = 0; lane < Lanes; lane++)
+		{
+			if (active[lane])
+			{
+				stack[sp[lane]][lane] = pc[lane];
+				sp[lane] = (sp[lane] + 1) & 0xF;
+				pc[lane] = NNN;
+			}
+		}
+		break;
+
+	case 0x3000: // 3XNN: Skips the next instruction if VX equals NN.
+		for (int lane = 0; lane < Lanes; lane++)
+		{
+			pc[lane] += active[lane] ? (VX[lane] == NN ? 4 : 2) : 0;
+		}
+		break;
+
+	case 0x4000: // 4XNN: Skips the next instruction if VX doesn't equal NN.
+		for (int lane = 0; lane < Lanes; lane++)
+		{
+			pc[lane] += active[lane] ? (VX[lane] != NN ? 4 : 2) : 0;
+		}
+		break;
+
+	case 0x5000: // 5XY0: Skips the next instruction if VX equals VY.
+		for (int lane = 0; lane < Lanes; lane++)
+		{
+			pc[lane] += active[lane] ? (VX[lane] == VY[lane] ? 4 : 2) : 0;
+		}
+		break;
+
+	case 0x6000: // 6XNN: Sets VX to NN.
+		for (int lane = 0; lane < Lanes; lane++)
+		{
+			VX[lane] = active[lane] ? NN : VX[lane];
+			pc[lane] += active[lane] ? 2 : 0;
+		}
+		break;
+
+	case 0x7000: // 7XNN: Adds NN to VX.
+		for (int lane = 0; lane < Lanes; lane++)
+		{
+			VX[lane] += active[lane] ? NN : 0;
+			pc[lane] += active[lane] ? 2 : 0;
+		}
+		break;
+
+	case 0x8000:
+		for (int lane = 0; lane < Lanes; lane++)
+		{
+			if (!active[lane])
+			{
+				continue;
+			}
+
+			switch (N)
+			{
+			case 0x0: VX[lane] = VY[lane]; break; // 8XY0: Sets VX to the value of VY.
+			case 0x1: VX[lane] |= VY[lane]; break; // 8XY1: Sets VX to VX | VY.
+			case 0x2: VX[lane] &= VY[lane]; break; // 8XY2: Sets VX to VX & VY.
+			case 0x3: VX[lane] ^= VY[lane]; break; // 8XY3: Sets VX to VX xor VY.
+			case 0x4: // 8XY4: Adds VY to VX. VF is set to 1 when there's a carry, and to 0 when there isn't.
+				VF[lane] = VX[lane] + VY[lane] > 0xFF ? 1 : 0;
+				VX[lane] += VY[lane];
+				break;
+			case 0x5: // 8XY5: VY is subtracted from VX. VF is set to 0 when there's a borrow, and 1 when there isn't.
+				VF[lane] = VX[lane] >= VY[lane] ? 1 : 0;
+				VX[lane] -= VY[lane];
+				break;
+			case 0x6: // 8XY6: Shifts VX right by one. VF is set to the value of the least significant bit of VX before the shift.
+				VF[lane] = VX[lane] & 0x1;
+				VX[lane] >>= 1;
+				break;
+			case 0x7: // 8XY7: Sets VX to VY minus VX. VF is set to 0 when there's a borrow, and 1 when there isn't.
+				VF[lane] = VY[lane] >= VX[lane] ? 1 : 0;
+				VX[lane] = VY[lane] - VX[lane];
+				break;
+			case 0xE: // 8XYE: Shifts VX left by one. VF is set to the value of the most significant bit of VX before the shift.
+				VF[lane] = VX[lane] & 0x80;
+				VX[lane] <<= 1;
+				break;
+			default:
+				continue; // Unknown, pc stays
+			}
+			pc[lane] += 2;
+		}
+		break;
+
+	case 0x9000: // 9XY0: Skips the next instruction if VX doesn't equal VY.
+		for (int lane = 0; lane < Lanes; lane++)
+		{
+			pc[lane] += active[lane] ? (VX[lane] != VY[lane] ? 4 : 2) : 0;
+		}
+		break;
+
+	case 0xA000: // ANNN: Sets I to the address NNN
+		for (int lane = 0; lane < Lanes; lane++)
+		{
+			I[lane] = active[lane] ? NNN : I[lane];
+			pc[lane] += active[lane] ? 2 : 0;
+		}
+		break;
+
+	case 0xB000: // BNNN: Jumps to the address NNN plus V0.
+		for (int lane = 0; lane < Lanes; lane++)
+		{
+			pc[lane] = active[lane] ? static_cast<unsigned short>(V[0][lane] + NNN) : pc[lane];
+		}
+		break;
+
+	case 0xC000: // CXNN: Sets VX to the result of a bitwise and operation on a random number and NN.
+		for (int lane = 0; lane < Lanes; lane++)
+		{
+			if (active[lane])
+			{
+				VX[lane] = NN & NextRandom(lane);
+				pc[lane] += 2;
+			}
+		}
+		break;
+
+	case 0xD000: // DXYN: Draw sprite at location VX,VY on screen. Sprite is N lines high.
+		for (int lane = 0; lane < Lanes; lane++)
+		{
+			if (active[lane])
+			{
+				Draw(lane, X, Y, N);
+				pc[lane] += 2;
+			}
+		}
+		break;
+
+	case 0xE000:
+		if (NN == 0x9E || NN == 0xA1) // EX9E/EXA1: Skips the next instruction if the key stored in VX is (isn't) pressed.
+		{
+			bool skipIfPressed = NN == 0x9E;
+			for (int lane = 0; lane < Lanes; lane++)
+			{
+				bool pressed = (keys[lane] >> (VX[lane] & 0xF) & 1) != 0;
+				pc[lane] += active[lane] ? (pressed == skipIfPressed ? 4 : 2) : 0;
+			}
+		}
+		break;
+
+	case 0xF000:
+		for (int lane = 0; lane < Lanes; lane++)
+		{
+			if (!active[lane])
+			{
+				continue;
+			}
+
+			unsigned char* laneMemory = memory[lane];
+			switch (NN)
+			{
+			case 0x07: VX[lane] = delayTimer[lane]; break; // FX07: Sets VX to the value of the delay timer.
+			case 0x0A: // FX0A: A key press is awaited, and then stored in VX.
+				if (keys[lane] == 0)
+				{
+					continue; // pc stays until a key is down
+				}
+				for (unsigned char key = 0; key < 16; key++)
+				{
+					if (keys[lane] >> key & 1)
+					{
+						VX[lane] = key;
+						break;
+					}
+				}
+				break;
+			case 0x15: delayTimer[lane] = VX[lane]; break; // FX15: Sets the delay timer to VX.
+			case 0x18: soundTimer[lane] = VX[lane]; break; // FX18: Sets the sound timer to VX.
+			case 0x1E: // FX1E: Adds VX to I. VF is set to 1 if I+VX>0xFFF.
+				VF[lane] = VX[lane] + I[lane] > 0xFFF ? 1 : 0;
+				I[lane] += VX[lane];
+				break;
+			case 0x29: I[lane] = static_cast<unsigned short>(VX[lane] * 5); break; // FX29: Sets I to the font sprite for VX.
+			case 0x33: // FX33: Stores the binary-coded decimal representation of VX at I, I+1 and I+2.
+				MarkWritten(I[lane], 3);
+				laneMemory[I[lane] & 0xFFF] = VX[lane] / 100;
+				laneMemory[(I[lane] + 1) & 0xFFF] = VX[lane] / 10 % 10;
+				laneMemory[(I[lane] + 2) & 0xFFF] = VX[lane] % 10;
+				break;
+			case 0x55: // FX55: Stores V0 to VX in memory starting at address I.  I is unchanged.
+				MarkWritten(I[lane], X + 1);
+				for (int i = 0; i <= X; i++)
+				{
+					laneMemory[(I[lane] + i) & 0xFFF] = V[i][lane];
+				}
+				break;
+			case 0x65: // FX65: Fills V0 to VX with values from memory starting at address I.  I is unchanged.
+				for (int i = 0; i <= X; i++)
+				{
+					V[i][lane] = laneMemory[(I[lane] + i) & 0xFFF];
+				}
+				break;
+			default:
+				continue; // Unknown, pc stays
+			}
+			pc[lane] += 2;
+		}
+		break;
+	}
+}
+
+// Same row-wide blitter as Chip8Emu::OpDXYN
+void Chip8Lockstep::Draw(int lane, unsigned char X, unsigned char Y, unsigned char N)
+{
+	unsigned int x = V[X][lane] % 64;
+	unsigned int y = V[Y][lane] % 32;
+
+	V[0xF][lane] = 0;
+	for (unsigned int yline = 0; yline < N && y + yline < 32; yline++)
+	{
+		uint64_t spriteMask = static_cast<uint64_t>(memory[lane][(I[lane] + yline) & 0xFFF]) << 56 >> x;
+		if ((gfxRows[y + yline][lane] & spriteMask) != 0)
+		{
+			V[0xF][lane] = 1;
+		}
+		gfxRows[y + yline][lane] ^= spriteMask;
+	}
+}
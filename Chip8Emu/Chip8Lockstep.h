@@ -0,0 +1,87 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// The vector engines are built with MSVC and GCC on x86-64, which both compile AVX2 and AVX-512 intrinsics
+// in one translation unit without enabling those instruction sets for the whole build
+#if (defined(_M_X64) && defined(_MSC_VER) && !defined(__clang__)) || (defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__))
+#define CHIP8_LOCKSTEP_SIMD
+#endif
+
+// Lane engines, selectable per instance. All of them produce the same lanes; the vector ones apply each
+// instruction to every active lane with a handful of vector operations instead of a loop over the lanes.
+enum class LockstepEngine
+{
+	Scalar, // Per-lane loops, runs everywhere
+	Avx2,   // 256-bit vectors, lane sets expanded into vector masks
+	Avx512  // AVX-512 BW/VL, lane sets kept in mask registers
+};
+
+// Runs Lanes instances of the same ROM in lockstep, the multi-instance counterpart to Chip8Emu::Execute.
+// Machine state is stored structure-of-arrays (one array element per lane), so each opcode is decoded once
+// and then applied to every lane that is at the same pc with the same instruction. Lanes whose pc has
+// diverged wait and are scheduled on their own; the lane with the lowest pc always runs next, which lets
+// diverged lanes rejoin the others when their paths meet again.
+class Chip8Lockstep
+{
+public:
+	static const int Lanes = 16;
+
+	LockstepEngine engine = FastestEngine(); // An engine this build or CPU can't run falls back to Scalar
+
+	static bool EngineSupported(LockstepEngine engine);
+	static LockstepEngine FastestEngine(); // Picked at run time from what the CPU supports
+
+	void Start();
+	bool LoadRom(const char* filename); // Loads the ROM into every lane, false if it can't be opened or doesn't fit
+	bool LoadRom(const unsigned char* data, size_t size);
+	void Seed(int lane, uint64_t seed);
+	void SetKeys(int lane, unsigned short keys); // Keypad state for one lane, bit n is key n
+	void SetInstructionsPerSecond(int ips); // Same as Chip8Emu::SetInstructionsPerSecond, at least 1
+	int GetInstructionsPerSecond() const;
+	void RunCycles(int cycles); // Every lane executes cycles instructions
+
+	uint64_t FrameHash(int lane) const; // Same hash as Chip8Emu::FrameHash
+	unsigned long long GetCycleCount(int lane) const;
+	double LaneUtilization() const; // Average fraction of lanes executing per lockstep step
+
+private:
+	unsigned short Fetch(int lane) const;
+	void RunScalar(int cycles);
+	void Execute(unsigned short opcode, const bool active[Lanes]);
+	void Draw(int lane, unsigned char X, unsigned char Y, unsigned char N);
+	unsigned char NextRandom(int lane);
+	void MarkWritten(unsigned int address, unsigned int length);
+	bool MayDiffer(unsigned int address, unsigned int length) const;
+
+#ifdef CHIP8_LOCKSTEP_SIMD
+	// Vector engines, one translation unit per instruction set (Chip8LockstepLanes.h)
+	template <class Simd> void RunLanes(int cycles);
+	template <class Simd> void ExecuteLanes(unsigned short opcode, unsigned int active);
+	void RunAvx2(int cycles);
+	void RunAvx512(int cycles);
+#endif
+
+	int instructionsPerSecond = 600;
+
+	// State, indexed [register][lane] so one register across all lanes is contiguous
+	alignas(32) unsigned char V[16][Lanes];
+	alignas(32) unsigned short I[Lanes];
+	alignas(32) unsigned short pc[Lanes];
+	alignas(32) unsigned short stack[16][Lanes];
+	alignas(32) unsigned char sp[Lanes];
+	alignas(32) unsigned char delayTimer[Lanes];
+	alignas(32) unsigned char soundTimer[Lanes];
+	alignas(64) unsigned int timerAccumulator[Lanes];
+	alignas(32) unsigned short keys[Lanes];
+	uint64_t rngState[Lanes];
+	unsigned long long cycleCount[Lanes];
+
+	alignas(64) uint64_t gfxRows[32][Lanes];
+	unsigned char memory[Lanes][4096];
+	uint64_t writtenMask[4096 / 64]; // Bytes some lane has stored to since Start, where lanes' memory can differ
+
+	// Statistics
+	unsigned long long steps;
+	unsigned long long laneSteps;
+};
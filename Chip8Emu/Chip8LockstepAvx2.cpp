@@ -0,0 +1,136 @@
+#include "Chip8Lockstep.h"
+
+#ifdef CHIP8_LOCKSTEP_SIMD
+#include <immintrin.h>
+
+// Everything below is built for AVX2; Chip8Lockstep::RunCycles only comes here when the CPU has it.
+// MSVC compiles the intrinsics without any option.
+#ifdef __GNUC__
+#pragma GCC target("avx2,popcnt")
+#endif
+
+#include "Chip8LockstepLanes.h"
+
+namespace
+{
+	// AVX2 compares produce vectors, lane sets are converted to and from them by testing one bit per lane
+	struct Avx2Lanes : LaneVectors
+	{
+		static Bytes ByteMask(unsigned int set)
+		{
+			const __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+			const __m128i spread = _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1);
+			__m128i lanes = _mm_shuffle_epi8(_mm_cvtsi32_si128(static_cast<int>(set)), spread);
+			return _mm_cmpeq_epi8(_mm_and_si128(lanes, bits), bits);
+		}
+
+		static Words WordMask(unsigned int set)
+		{
+			const __m256i bits = _mm256_setr_epi16(1, 2, 4, 8, 16, 32, 64, 128, 0x100, 0x200, 0x400, 0x800, 0x1000, 0x2000, 0x4000, -0x8000);
+			return _mm256_cmpeq_epi16(_mm256_and_si256(_mm256_set1_epi16(static_cast<short>(set)), bits), bits);
+		}
+
+		static __m256i DwordMask(unsigned int set) // Lanes 0-7 of set
+		{
+			const __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+			return _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(static_cast<int>(set)), bits), bits);
+		}
+
+		static unsigned int WordSet(Words mask)
+		{
+			__m128i bytes = _mm_packs_epi16(_mm256_castsi256_si128(mask), _mm256_extracti128_si256(mask, 1));
+			return static_cast<unsigned int>(_mm_movemask_epi8(bytes));
+		}
+
+		static void StoreBytes(unsigned char* row, unsigned int set, Bytes value)
+		{
+			__m128i* lanes = reinterpret_cast<__m128i*>(row);
+			_mm_storeu_si128(lanes, _mm_blendv_epi8(_mm_loadu_si128(lanes), value, ByteMask(set)));
+		}
+
+		static void StoreWords(unsigned short* row, unsigned int set, Words value)
+		{
+			__m256i* lanes = reinterpret_cast<__m256i*>(row);
+			_mm256_storeu_si256(lanes, _mm256_blendv_epi8(_mm256_loadu_si256(lanes), value, WordMask(set)));
+		}
+
+		static Bytes MaskedBytes(unsigned int set, unsigned char value)
+		{
+			return _mm_and_si128(ByteMask(set), _mm_set1_epi8(static_cast<char>(value)));
+		}
+
+		static unsigned int EqualBytes(Bytes a, Bytes b)
+		{
+			return static_cast<unsigned int>(_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)));
+		}
+
+		static unsigned int AtLeastBytes(Bytes a, Bytes b)
+		{
+			return EqualBytes(_mm_max_epu8(a, b), a);
+		}
+
+		static unsigned int EqualWords(Words a, Words b)
+		{
+			return WordSet(_mm256_cmpeq_epi16(a, b));
+		}
+
+		static unsigned int AboveWords(Words a, Words b)
+		{
+			return ~EqualWords(_mm256_max_epu16(a, b), b) & 0xFFFF;
+		}
+
+		// Only 32-bit lanes have variable shifts, so shift each half widened and pack the results back
+		static Words ShiftRightWords(Words value, Words counts)
+		{
+			__m256i low = _mm256_srlv_epi32(_mm256_cvtepu16_epi32(_mm256_castsi256_si128(value)), _mm256_cvtepu16_epi32(_mm256_castsi256_si128(counts)));
+			__m256i high = _mm256_srlv_epi32(_mm256_cvtepu16_epi32(_mm256_extracti128_si256(value, 1)), _mm256_cvtepu16_epi32(_mm256_extracti128_si256(counts, 1)));
+			return _mm256_permute4x64_epi64(_mm256_packus_epi32(low, high), 0xD8); // packus works within 128-bit halves
+		}
+
+		static unsigned int XorQwords(uint64_t* row, unsigned int set, uint64_t value)
+		{
+			const __m256i bits = _mm256_setr_epi64x(1, 2, 4, 8);
+			const __m256i pattern = _mm256_set1_epi64x(static_cast<long long>(value));
+			unsigned int hit = 0;
+			for (int quarter = 0; quarter < 4; quarter++)
+			{
+				__m256i* lanes = reinterpret_cast<__m256i*>(row + quarter * 4);
+				__m256i mask = _mm256_cmpeq_epi64(_mm256_and_si256(_mm256_set1_epi64x(set >> (quarter * 4)), bits), bits);
+				__m256i current = _mm256_loadu_si256(lanes);
+				__m256i clear = _mm256_cmpeq_epi64(_mm256_and_si256(current, pattern), _mm256_setzero_si256());
+				_mm256_storeu_si256(lanes, _mm256_xor_si256(current, _mm256_and_si256(mask, pattern)));
+				hit |= (~static_cast<unsigned int>(_mm256_movemask_pd(_mm256_castsi256_pd(clear))) & 0xF) << (quarter * 4);
+			}
+			return hit & set;
+		}
+
+		static unsigned short MinWord(unsigned int set, Words values)
+		{
+			Words candidates = _mm256_blendv_epi8(_mm256_set1_epi16(-1), values, WordMask(set));
+			__m128i halves = _mm_min_epu16(_mm256_castsi256_si128(candidates), _mm256_extracti128_si256(candidates, 1));
+			return static_cast<unsigned short>(_mm_cvtsi128_si32(_mm_minpos_epu16(halves)));
+		}
+
+		static unsigned int Accumulate(unsigned int* values, unsigned int set, unsigned int step, unsigned int period)
+		{
+			const __m256i limit = _mm256_set1_epi32(static_cast<int>(period));
+			unsigned int reached = 0;
+			for (int half = 0; half < 2; half++)
+			{
+				__m256i* lanes = reinterpret_cast<__m256i*>(values + half * 8);
+				__m256i added = _mm256_and_si256(DwordMask(set >> (half * 8)), _mm256_set1_epi32(static_cast<int>(step)));
+				__m256i sum = _mm256_add_epi32(_mm256_loadu_si256(lanes), added);
+				__m256i ticked = _mm256_cmpeq_epi32(_mm256_max_epu32(sum, limit), sum);
+				_mm256_storeu_si256(lanes, _mm256_sub_epi32(sum, _mm256_and_si256(ticked, limit)));
+				reached |= static_cast<unsigned int>(_mm256_movemask_ps(_mm256_castsi256_ps(ticked))) << (half * 8);
+			}
+			return reached;
+		}
+	};
+}
+
+void Chip8Lockstep::RunAvx2(int cycles)
+{
+	RunLanes<Avx2Lanes>(cycles);
+}
+#endif
@@ -0,0 +1,78 @@
+#include "Chip8Lockstep.h"
+
+#ifdef CHIP8_LOCKSTEP_SIMD
+#include <immintrin.h>
+
+// Everything below is built for AVX-512 BW/VL; Chip8Lockstep::RunCycles only comes here when the CPU has it.
+// MSVC compiles the intrinsics without any option.
+#ifdef __GNUC__
+#pragma GCC target("avx2,avx512f,avx512bw,avx512vl,popcnt")
+#endif
+
+#include "Chip8LockstepLanes.h"
+
+namespace
+{
+	// A 16-lane set is exactly a mask register, so compares, masked stores and blends need no conversion
+	struct Avx512Lanes : LaneVectors
+	{
+		static void StoreBytes(unsigned char* row, unsigned int set, Bytes value)
+		{
+			_mm_mask_storeu_epi8(row, static_cast<__mmask16>(set), value);
+		}
+
+		static void StoreWords(unsigned short* row, unsigned int set, Words value)
+		{
+			_mm256_mask_storeu_epi16(row, static_cast<__mmask16>(set), value);
+		}
+
+		static Bytes MaskedBytes(unsigned int set, unsigned char value)
+		{
+			return _mm_maskz_set1_epi8(static_cast<__mmask16>(set), static_cast<char>(value));
+		}
+
+		static unsigned int EqualBytes(Bytes a, Bytes b) { return _mm_cmpeq_epi8_mask(a, b); }
+		static unsigned int AtLeastBytes(Bytes a, Bytes b) { return _mm_cmpge_epu8_mask(a, b); }
+		static unsigned int EqualWords(Words a, Words b) { return _mm256_cmpeq_epi16_mask(a, b); }
+		static unsigned int AboveWords(Words a, Words b) { return _mm256_cmpgt_epu16_mask(a, b); }
+		static Words ShiftRightWords(Words value, Words counts) { return _mm256_srlv_epi16(value, counts); }
+
+		static unsigned int XorQwords(uint64_t* row, unsigned int set, uint64_t value)
+		{
+			const __m512i pattern = _mm512_set1_epi64(static_cast<long long>(value));
+			unsigned int hit = 0;
+			for (int half = 0; half < 2; half++)
+			{
+				__mmask8 lanes = static_cast<__mmask8>(set >> (half * 8));
+				__m512i current = _mm512_loadu_si512(row + half * 8);
+				hit |= static_cast<unsigned int>(_mm512_mask_test_epi64_mask(lanes, current, pattern)) << (half * 8);
+				_mm512_storeu_si512(row + half * 8, _mm512_mask_xor_epi64(current, lanes, current, pattern));
+			}
+			return hit;
+		}
+
+		static unsigned short MinWord(unsigned int set, Words values)
+		{
+			Words candidates = _mm256_mask_blend_epi16(static_cast<__mmask16>(set), _mm256_set1_epi16(-1), values);
+			__m128i halves = _mm_min_epu16(_mm256_castsi256_si128(candidates), _mm256_extracti128_si256(candidates, 1));
+			return static_cast<unsigned short>(_mm_cvtsi128_si32(_mm_minpos_epu16(halves)));
+		}
+
+		// All 16 accumulators fit one ZMM register
+		static unsigned int Accumulate(unsigned int* values, unsigned int set, unsigned int step, unsigned int period)
+		{
+			const __m512i limit = _mm512_set1_epi32(static_cast<int>(period));
+			__m512i current = _mm512_loadu_si512(values);
+			__m512i sum = _mm512_mask_add_epi32(current, static_cast<__mmask16>(set), current, _mm512_set1_epi32(static_cast<int>(step)));
+			__mmask16 ticked = _mm512_cmpge_epu32_mask(sum, limit);
+			_mm512_storeu_si512(values, _mm512_mask_sub_epi32(sum, ticked, sum, limit));
+			return ticked;
+		}
+	};
+}
+
+void Chip8Lockstep::RunAvx512(int cycles)
+{
+	RunLanes<Avx512Lanes>(cycles);
+}
+#endif
@@ -0,0 +1,374 @@
+#pragma once
+
+// The lockstep loop of the vector engines. Chip8LockstepAvx2.cpp and Chip8LockstepAvx512.cpp include this
+// after <immintrin.h> and after switching code generation to their instruction set, and instantiate it
+// with their own lane operations, so each gets a copy built for its instruction set. Everything defined
+// here has internal linkage: a shared inline function could end up as the wider build for every caller.
+//
+// Lane sets are bit masks, bit n for lane n. Besides LaneVectors, an engine's Simd class provides:
+//   StoreBytes, StoreWords      write only the lanes in a set, the rest of the row keeps its value
+//   MaskedBytes                 value in the lanes of a set, 0 elsewhere
+//   EqualBytes, AtLeastBytes    lane sets of a == b and a >= b (unsigned)
+//   EqualWords, AboveWords      lane sets of a == b and a > b (unsigned)
+//   ShiftRightWords             per-lane shift counts
+//   XorQwords                   XORs a value into the lanes of a set in a row of 64-bit values, returns the
+//                               lanes of the set that had a bit of it set before
+//   MinWord                     smallest value over the lanes in a set
+//   Accumulate                  adds a step to the lanes in a set, then takes a period off every lane that
+//                               has reached it and returns those lanes
+
+namespace
+{
+	int LowestLane(unsigned int set)
+	{
+		return static_cast<int>(_mm_popcnt_u32((set & (0u - set)) - 1));
+	}
+
+	int LaneCount(unsigned int set)
+	{
+		return static_cast<int>(_mm_popcnt_u32(set));
+	}
+
+	// Operations both engines do the same way
+	struct LaneVectors
+	{
+		typedef __m128i Bytes; // One unsigned char per lane
+		typedef __m256i Words; // One unsigned short per lane
+
+		static Bytes LoadBytes(const unsigned char* row)
+		{
+			return _mm_loadu_si128(reinterpret_cast<const __m128i*>(row));
+		}
+
+		static Bytes SetBytes(unsigned char value)
+		{
+			return _mm_set1_epi8(static_cast<char>(value));
+		}
+
+		static Bytes AddBytes(Bytes a, Bytes b) { return _mm_add_epi8(a, b); }
+		static Bytes SubBytes(Bytes a, Bytes b) { return _mm_sub_epi8(a, b); }
+		static Bytes SubSaturateBytes(Bytes a, Bytes b) { return _mm_subs_epu8(a, b); }
+		static Bytes AndBytes(Bytes a, Bytes b) { return _mm_and_si128(a, b); }
+		static Bytes OrBytes(Bytes a, Bytes b) { return _mm_or_si128(a, b); }
+		static Bytes XorBytes(Bytes a, Bytes b) { return _mm_xor_si128(a, b); }
+
+		// There is no byte shift, shift words and drop the bit that crossed into each lower byte
+		static Bytes HalveBytes(Bytes a)
+		{
+			return _mm_and_si128(_mm_srli_epi16(a, 1), _mm_set1_epi8(0x7F));
+		}
+
+		static Words LoadWords(const unsigned short* row)
+		{
+			return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row));
+		}
+
+		static Words SetWords(unsigned short value)
+		{
+			return _mm256_set1_epi16(static_cast<short>(value));
+		}
+
+		static Words AddWords(Words a, Words b) { return _mm256_add_epi16(a, b); }
+		static Words SubWords(Words a, Words b) { return _mm256_sub_epi16(a, b); }
+		static Words AndWords(Words a, Words b) { return _mm256_and_si256(a, b); }
+		static Words MultiplyWords(Words a, Words b) { return _mm256_mullo_epi16(a, b); }
+		static Words WidenBytes(Bytes a) { return _mm256_cvtepu8_epi16(a); }
+	};
+
+	template <class Simd>
+	bool AllLanesEqual(const unsigned char* row, unsigned int set, unsigned char value)
+	{
+		return (Simd::EqualBytes(Simd::LoadBytes(row), Simd::SetBytes(value)) & set) == set;
+	}
+
+	template <class Simd>
+	bool AllLanesEqual(const unsigned short* row, unsigned int set, unsigned short value)
+	{
+		return (Simd::EqualWords(Simd::LoadWords(row), Simd::SetWords(value)) & set) == set;
+	}
+
+	// pc += 2 for the lanes in active, and 2 more for those in skip
+	template <class Simd>
+	void AdvanceLanes(unsigned short* pc, unsigned int active, unsigned int skip)
+	{
+		Simd::StoreWords(pc, active, Simd::AddWords(Simd::LoadWords(pc), Simd::SetWords(2)));
+		if (skip != 0)
+		{
+			Simd::StoreWords(pc, skip, Simd::AddWords(Simd::LoadWords(pc), Simd::SetWords(2)));
+		}
+	}
+}
+
+// Same scheduling as RunScalar, with the leader search, the lane comparison and the timers done on vectors.
+// Opcodes are fetched once from the leader; other lanes only need their own fetch where some lane has
+// written to memory, since everywhere else every lane still holds the ROM.
+template <class Simd>
+void Chip8Lockstep::RunLanes(int cycles)
+{
+	const unsigned int period = static_cast<unsigned int>(instructionsPerSecond);
+
+	while (cycles > 0)
+	{
+		// Per-lane counts are 16 bits wide. Lanes never interact, so running in chunks changes nothing.
+		int chunk = cycles < 0x8000 ? cycles : 0x8000;
+		cycles -= chunk;
+
+		alignas(32) unsigned short remaining[Lanes];
+		for (int lane = 0; lane < Lanes; lane++)
+		{
+			remaining[lane] = static_cast<unsigned short>(chunk);
+		}
+
+		for (;;)
+		{
+			unsigned int running = ~Simd::EqualWords(Simd::LoadWords(remaining), Simd::SetWords(0)) & 0xFFFF;
+			if (running == 0)
+			{
+				break;
+			}
+
+			typename Simd::Words pcs = Simd::LoadWords(pc);
+			unsigned short leaderPc = Simd::MinWord(running, pcs);
+			unsigned int active = Simd::EqualWords(pcs, Simd::SetWords(leaderPc)) & running;
+
+			int leader = LowestLane(active);
+			unsigned short opcode = static_cast<unsigned short>(memory[leader][leaderPc & 0xFFF] << 8 | memory[leader][(leaderPc + 1) & 0xFFF]);
+			if (MayDiffer(leaderPc, 2))
+			{
+				for (unsigned int others = active & (active - 1); others != 0; others &= others - 1)
+				{
+					int lane = LowestLane(others);
+					if (Fetch(lane) != opcode)
+					{
+						active &= ~(1u << lane);
+					}
+				}
+			}
+
+			ExecuteLanes<Simd>(opcode, active);
+
+			// Per-lane 60 Hz timers, as in Chip8Emu::RunUntil
+			Simd::StoreWords(remaining, active, Simd::SubWords(Simd::LoadWords(remaining), Simd::SetWords(1)));
+			for (unsigned int ticked = Simd::Accumulate(timerAccumulator, active, 60, period); ticked != 0; ticked = Simd::Accumulate(timerAccumulator, 0, 0, period))
+			{
+				Simd::StoreBytes(delayTimer, ticked, Simd::SubSaturateBytes(Simd::LoadBytes(delayTimer), Simd::SetBytes(1)));
+				Simd::StoreBytes(soundTimer, ticked, Simd::SubSaturateBytes(Simd::LoadBytes(soundTimer), Simd::SetBytes(1)));
+			}
+
+			steps++;
+			laneSteps += LaneCount(active);
+		}
+
+		for (int lane = 0; lane < Lanes; lane++)
+		{
+			cycleCount[lane] += chunk;
+		}
+	}
+}
+
+// Applies one instruction to the lanes in active, with the same flag and operand ordering as Execute (VF is
+// written first, then the operands are loaded again). Instructions whose lanes need different addresses or
+// stack slots, and those that write memory or draw random numbers, go through Execute one lane at a time.
+template <class Simd>
+void Chip8Lockstep::ExecuteLanes(unsigned short opcode, unsigned int active)
+{
+	unsigned char X = (opcode & 0x0F00) >> 8;
+	unsigned char Y = (opcode & 0x00F0) >> 4;
+	unsigned char N = opcode & 0x000F;
+	unsigned char NN = opcode & 0x00FF;
+	unsigned short NNN = opcode & 0x0FFF;
+
+	unsigned char* VX = V[X];
+	unsigned char* VY = V[Y];
+	unsigned char* VF = V[0xF];
+	int leader = LowestLane(active);
+	unsigned char depth = sp[leader];
+
+	switch (opcode & 0xF000)
+	{
+	case 0x0000:
+		if (opcode == 0x00EE && AllLanesEqual<Simd>(sp, active, depth)) // 00EE: Return from subroutine
+		{
+			unsigned char top = (depth - 1) & 0xF;
+			Simd::StoreBytes(sp, active, Simd::SetBytes(top));
+			Simd::StoreWords(pc, active, Simd::AddWords(Simd::LoadWords(stack[top]), Simd::SetWords(2)));
+			return;
+		}
+		break;
+
+	case 0x1000: // 1NNN: Jump to NNN
+		Simd::StoreWords(pc, active, Simd::SetWords(NNN));
+		return;
+
+	case 0x2000: // 2NNN: Call subroutine at NNN
+		if (AllLanesEqual<Simd>(sp, active, depth))
+		{
+			Simd::StoreWords(stack[depth], active, Simd::LoadWords(pc));
+			Simd::StoreBytes(sp, active, Simd::SetBytes((depth + 1) & 0xF));
+			Simd::StoreWords(pc, active, Simd::SetWords(NNN));
+			return;
+		}
+		break;
+
+	case 0x3000: // 3XNN: Skips the next instruction if VX equals NN.
+		AdvanceLanes<Simd>(pc, active, Simd::EqualBytes(Simd::LoadBytes(VX), Simd::SetBytes(NN)) & active);
+		return;
+
+	case 0x4000: // 4XNN: Skips the next instruction if VX doesn't equal NN.
+		AdvanceLanes<Simd>(pc, active, ~Simd::EqualBytes(Simd::LoadBytes(VX), Simd::SetBytes(NN)) & active);
+		return;
+
+	case 0x5000: // 5XY0: Skips the next instruction if VX equals VY.
+		AdvanceLanes<Simd>(pc, active, Simd::EqualBytes(Simd::LoadBytes(VX), Simd::LoadBytes(VY)) & active);
+		return;
+
+	case 0x6000: // 6XNN: Sets VX to NN.
+		Simd::StoreBytes(VX, active, Simd::SetBytes(NN));
+		AdvanceLanes<Simd>(pc, active, 0);
+		return;
+
+	case 0x7000: // 7XNN: Adds NN to VX.
+		Simd::StoreBytes(VX, active, Simd::AddBytes(Simd::LoadBytes(VX), Simd::SetBytes(NN)));
+		AdvanceLanes<Simd>(pc, active, 0);
+		return;
+
+	case 0x8000:
+		switch (N)
+		{
+		case 0x0: Simd::StoreBytes(VX, active, Simd::LoadBytes(VY)); break; // 8XY0: Sets VX to the value of VY.
+		case 0x1: Simd::StoreBytes(VX, active, Simd::OrBytes(Simd::LoadBytes(VX), Simd::LoadBytes(VY))); break; // 8XY1: Sets VX to VX | VY.
+		case 0x2: Simd::StoreBytes(VX, active, Simd::AndBytes(Simd::LoadBytes(VX), Simd::LoadBytes(VY))); break; // 8XY2: Sets VX to VX & VY.
+		case 0x3: Simd::StoreBytes(VX, active, Simd::XorBytes(Simd::LoadBytes(VX), Simd::LoadBytes(VY))); break; // 8XY3: Sets VX to VX xor VY.
+		case 0x4: // 8XY4: Adds VY to VX. VF is set to 1 when there's a carry, and to 0 when there isn't.
+		{
+			// The 8-bit sum wrapped exactly when it came out below VX
+			typename Simd::Bytes x = Simd::LoadBytes(VX);
+			unsigned int carry = ~Simd::AtLeastBytes(Simd::AddBytes(x, Simd::LoadBytes(VY)), x);
+			Simd::StoreBytes(VF, active, Simd::MaskedBytes(carry, 1));
+			Simd::StoreBytes(VX, active, Simd::AddBytes(Simd::LoadBytes(VX), Simd::LoadBytes(VY)));
+			break;
+		}
+		case 0x5: // 8XY5: VY is subtracted from VX. VF is set to 0 when there's a borrow, and 1 when there isn't.
+			Simd::StoreBytes(VF, active, Simd::MaskedBytes(Simd::AtLeastBytes(Simd::LoadBytes(VX), Simd::LoadBytes(VY)), 1));
+			Simd::StoreBytes(VX, active, Simd::SubBytes(Simd::LoadBytes(VX), Simd::LoadBytes(VY)));
+			break;
+		case 0x6: // 8XY6: Shifts VX right by one. VF is set to the value of the least significant bit of VX before the shift.
+			Simd::StoreBytes(VF, active, Simd::AndBytes(Simd::LoadBytes(VX), Simd::SetBytes(0x1)));
+			Simd::StoreBytes(VX, active, Simd::HalveBytes(Simd::LoadBytes(VX)));
+			break;
+		case 0x7: // 8XY7: Sets VX to VY minus VX. VF is set to 0 when there's a borrow, and 1 when there isn't.
+			Simd::StoreBytes(VF, active, Simd::MaskedBytes(Simd::AtLeastBytes(Simd::LoadBytes(VY), Simd::LoadBytes(VX)), 1));
+			Simd::StoreBytes(VX, active, Simd::SubBytes(Simd::LoadBytes(VY), Simd::LoadBytes(VX)));
+			break;
+		case 0xE: // 8XYE: Shifts VX left by one. VF is set to the value of the most significant bit of VX before the shift.
+			Simd::StoreBytes(VF, active, Simd::AndBytes(Simd::LoadBytes(VX), Simd::SetBytes(0x80)));
+			Simd::StoreBytes(VX, active, Simd::AddBytes(Simd::LoadBytes(VX), Simd::LoadBytes(VX)));
+			break;
+		default:
+			return; // Unknown, pc stays
+		}
+		AdvanceLanes<Simd>(pc, active, 0);
+		return;
+
+	case 0x9000: // 9XY0: Skips the next instruction if VX doesn't equal VY.
+		AdvanceLanes<Simd>(pc, active, ~Simd::EqualBytes(Simd::LoadBytes(VX), Simd::LoadBytes(VY)) & active);
+		return;
+
+	case 0xA000: // ANNN: Sets I to the address NNN
+		Simd::StoreWords(I, active, Simd::SetWords(NNN));
+		AdvanceLanes<Simd>(pc, active, 0);
+		return;
+
+	case 0xB000: // BNNN: Jumps to the address NNN plus V0.
+		Simd::StoreWords(pc, active, Simd::AddWords(Simd::WidenBytes(Simd::LoadBytes(V[0])), Simd::SetWords(NNN)));
+		return;
+
+	case 0xD000: // DXYN: Draw sprite at location VX,VY on screen. Sprite is N lines high.
+		// Lanes drawing the same sprite bytes at the same place only differ in what's already on screen
+		if (AllLanesEqual<Simd>(VX, active, VX[leader]) && AllLanesEqual<Simd>(VY, active, VY[leader])
+			&& AllLanesEqual<Simd>(I, active, I[leader]) && !MayDiffer(I[leader], N))
+		{
+			unsigned int x = VX[leader] % 64;
+			unsigned int y = VY[leader] % 32;
+			unsigned int collided = 0;
+			for (unsigned int yline = 0; yline < N && y + yline < 32; yline++)
+			{
+				uint64_t spriteMask = static_cast<uint64_t>(memory[leader][(I[leader] + yline) & 0xFFF]) << 56 >> x;
+				collided |= Simd::XorQwords(gfxRows[y + yline], active, spriteMask);
+			}
+			Simd::StoreBytes(VF, active, Simd::MaskedBytes(collided, 1));
+			AdvanceLanes<Simd>(pc, active, 0);
+			return;
+		}
+		break;
+
+	case 0xE000:
+		if (NN == 0x9E || NN == 0xA1) // EX9E/EXA1: Skips the next instruction if the key stored in VX is (isn't) pressed.
+		{
+			typename Simd::Words key = Simd::WidenBytes(Simd::AndBytes(Simd::LoadBytes(VX), Simd::SetBytes(0xF)));
+			typename Simd::Words down = Simd::AndWords(Simd::ShiftRightWords(Simd::LoadWords(keys), key), Simd::SetWords(1));
+			unsigned int pressed = Simd::EqualWords(down, Simd::SetWords(1));
+			AdvanceLanes<Simd>(pc, active, (NN == 0x9E ? pressed : ~pressed) & active);
+			return;
+		}
+		break;
+
+	case 0xF000:
+		switch (NN)
+		{
+		case 0x07: // FX07: Sets VX to the value of the delay timer.
+			Simd::StoreBytes(VX, active, Simd::LoadBytes(delayTimer));
+			AdvanceLanes<Simd>(pc, active, 0);
+			return;
+		case 0x0A: // FX0A: A key press is awaited, and then stored in VX.
+			// Lanes with no key down stay on this instruction, only the others go through Execute
+			active &= ~Simd::EqualWords(Simd::LoadWords(keys), Simd::SetWords(0));
+			if (active == 0)
+			{
+				return;
+			}
+			break;
+		case 0x15: // FX15: Sets the delay timer to VX.
+			Simd::StoreBytes(delayTimer, active, Simd::LoadBytes(VX));
+			AdvanceLanes<Simd>(pc, active, 0);
+			return;
+		case 0x18: // FX18: Sets the sound timer to VX.
+			Simd::StoreBytes(soundTimer, active, Simd::LoadBytes(VX));
+			AdvanceLanes<Simd>(pc, active, 0);
+			return;
+		case 0x1E: // FX1E: Adds VX to I. VF is set to 1 if I+VX>0xFFF.
+		{
+			// Compared as I > 0xFFF - VX, which can't wrap the way the 16-bit sum can
+			typename Simd::Words limit = Simd::SubWords(Simd::SetWords(0xFFF), Simd::WidenBytes(Simd::LoadBytes(VX)));
+			Simd::StoreBytes(VF, active, Simd::MaskedBytes(Simd::AboveWords(Simd::LoadWords(I), limit), 1));
+			Simd::StoreWords(I, active, Simd::AddWords(Simd::LoadWords(I), Simd::WidenBytes(Simd::LoadBytes(VX))));
+			AdvanceLanes<Simd>(pc, active, 0);
+			return;
+		}
+		case 0x29: // FX29: Sets I to the font sprite for VX.
+			Simd::StoreWords(I, active, Simd::MultiplyWords(Simd::WidenBytes(Simd::LoadBytes(VX)), Simd::SetWords(5)));
+			AdvanceLanes<Simd>(pc, active, 0);
+			return;
+		case 0x65: // FX65: Fills V0 to VX with values from memory starting at address I.  I is unchanged.
+			// Where no lane has written, every lane reads the same bytes and each register is one broadcast
+			if (AllLanesEqual<Simd>(I, active, I[leader]) && !MayDiffer(I[leader], X + 1))
+			{
+				for (int i = 0; i <= X; i++)
+				{
+					Simd::StoreBytes(V[i], active, Simd::SetBytes(memory[leader][(I[leader] + i) & 0xFFF]));
+				}
+				AdvanceLanes<Simd>(pc, active, 0);
+				return;
+			}
+			break;
+		}
+		break;
+	}
+
+	bool lanes[Lanes];
+	for (int lane = 0; lane < Lanes; lane++)
+	{
+		lanes[lane] = (active >> lane & 1) != 0;
+	}
+	Execute(opcode, lanes);
+}
@@ -0,0 +1,146 @@
+#include "Chip8Runner.h"
+
+#include <algorithm>
+#include <thread>
+
+void Chip8Runner::SetBatchCycles(int cycles)
+{
+	batchCycles = std::max(1, cycles); // A batch of none would never finish a job
+}
+
+int Chip8Runner::GetBatchCycles() const
+{
+	return batchCycles;
+}
+
+std::vector<RunnerResult> Chip8Runner::Run(const std::vector<RunnerJob>& jobs)
+{
+	int threads = threadCount > 0 ? threadCount : static_cast<int>(std::thread::hardware_concurrency());
+	threads = std::max(1, std::min(threads, static_cast<int>(jobs.size())));
+
+	std::vector<RunnerResult> results(jobs.size());
+	if (jobs.empty())
+	{
+		return results;
+	}
+
+	// Deal out contiguous slices of the job list
+	queues.clear();
+	instances.clear();
+	for (int i = 0; i < threads; i++)
+	{
+		uint64_t head = jobs.size() * i / threads;
+		uint64_t tail = jobs.size() * (i + 1) / threads;
+		queues.push_back(std::make_unique<WorkQueue>());
+		queues.back()->range = head << 32 | tail;
+		instances.push_back(std::make_unique<Chip8Emu>());
+	}
+
+	std::vector<std::thread> pool;
+	for (int i = 1; i < threads; i++)
+	{
+		pool.emplace_back(&Chip8Runner::Worker, this, i, std::cref(jobs), std::ref(results));
+	}
+	Worker(0, jobs, results);
+	for (std::thread& thread : pool)
+	{
+		thread.join();
+	}
+
+	return results;
+}
+
+bool Chip8Runner::PopFront(WorkQueue& queue, unsigned int& job)
+{
+	uint64_t range = queue.range.load(std::memory_order_relaxed);
+	for (;;)
+	{
+		uint64_t head = range >> 32;
+		uint64_t tail = range & 0xFFFFFFFF;
+		if (head >= tail)
+		{
+			return false;
+		}
+		if (queue.range.compare_exchange_weak(range, (head + 1) << 32 | tail, std::memory_order_acq_rel))
+		{
+			job = static_cast<unsigned int>(head);
+			return true;
+		}
+	}
+}
+
+bool Chip8Runner::StealBack(WorkQueue& queue, unsigned int& job)
+{
+	uint64_t range = queue.range.load(std::memory_order_relaxed);
+	for (;;)
+	{
+		uint64_t head = range >> 32;
+		uint64_t tail = range & 0xFFFFFFFF;
+		if (head >= tail)
+		{
+			return false;
+		}
+		if (queue.range.compare_exchange_weak(range, head << 32 | (tail - 1), std::memory_order_acq_rel))
+		{
+			job = static_cast<unsigned int>(tail - 1);
+			return true;
+		}
+	}
+}
+
+void Chip8Runner::Worker(int self, const std::vector<RunnerJob>& jobs, std::vector<RunnerResult>& results)
+{
+	Chip8Emu& emu = *instances[self];
+	int threads = static_cast<int>(queues.size());
+
+	unsigned int job;
+	for (;;)
+	{
+		if (PopFront(*queues[self], job))
+		{
+			RunJob(jobs[job], emu, results[job]);
+			continue;
+		}
+
+		// Own queue is empty, look for work elsewhere starting with the next thread over
+		bool stolen = false;
+		for (int i = 1; i < threads && !stolen; i++)
+		{
+			stolen = StealBack(*queues[(self + i) % threads], job);
+		}
+		if (!stolen)
+		{
+			return; // Queues only ever shrink, so nothing is left anywhere
+		}
+		RunJob(jobs[job], emu, results[job]);
+	}
+}
+
+void Chip8Runner::RunJob(const RunnerJob& job, Chip8Emu& emu, RunnerResult& result) const
+{
+	emu.rngSeed = job.seed;
+	emu.SetInstructionsPerSecond(job.instructionsPerSecond);
+	emu.dispatch = dispatch;
+	emu.Start();
+	bool loaded = job.romData ? emu.LoadRom(job.romData, job.romSize) : emu.LoadRom(job.romPath.c_str());
+	if (!loaded)
+	{
+		return;
+	}
+	result.loaded = true;
+
+	unsigned long long remaining = job.cycles;
+	while (remaining > 0)
+	{
+		if (job.input)
+		{
+			job.input(emu, emu.GetCycleCount());
+		}
+		int batch = static_cast<int>(std::min<unsigned long long>(remaining, batchCycles));
+		emu.RunCycles(batch);
+		remaining -= batch;
+	}
+
+	result.cycles = emu.GetCycleCount();
+	result.frameHash = emu.FrameHash();
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include "Chip8Emu.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Input source for one instance, called before every batch with the cycle count the instance has reached.
+// It can set the keypad directly (SetKeys) or queue changes at exact cycles within the batch (QueueKeys).
+typedef std::function<void(Chip8Emu& emu, unsigned long long cycle)> InputSource;
+
+// One ROM run: which ROM, how long, and with what seed and input
+struct RunnerJob
+{
+	std::string romPath;
+	const unsigned char* romData = nullptr; // ROM image already in memory (e.g. a RomPack entry), used instead of romPath
+	size_t romSize = 0;
+	unsigned long long cycles = 0;
+	uint64_t seed = 0;
+	int instructionsPerSecond = 600; // e.g. the ROM's RomIndex entry
+	InputSource input; // Optional
+};
+
+struct RunnerResult
+{
+	bool loaded = false;
+	unsigned long long cycles = 0;
+	uint64_t frameHash = 0; // Hash of the final display
+};
+
+// Runs many independent Chip8Emu instances across a pool of threads. Jobs are dealt out to per-thread
+// queues up front; a thread that empties its own queue steals from the back of the others, so uneven
+// job lengths still keep every core busy. Each job writes only its own result slot, so collecting
+// results needs no locks.
+class Chip8Runner
+{
+public:
+	int threadCount = 0; // 0 uses every hardware thread
+	Dispatch dispatch = Dispatch::Cached;
+
+	void SetBatchCycles(int cycles); // Cycles between input callbacks, at least 1
+	int GetBatchCycles() const;
+	std::vector<RunnerResult> Run(const std::vector<RunnerJob>& jobs);
+
+private:
+	// A thread's share of the jobs, the range [head, tail) of job indices packed into one atomic
+	// so the owner (taking from the head) and thieves (taking from the tail) never hand out a job twice
+	struct WorkQueue
+	{
+		std::atomic<uint64_t> range{ 0 };
+	};
+
+	static bool PopFront(WorkQueue& queue, unsigned int& job);
+	static bool StealBack(WorkQueue& queue, unsigned int& job);
+	void RunJob(const RunnerJob& job, Chip8Emu& emu, RunnerResult& result) const;
+	void Worker(int self, const std::vector<RunnerJob>& jobs, std::vector<RunnerResult>& results);
+
+	int batchCycles = 10000;
+	std::vector<std::unique_ptr<WorkQueue>> queues;
+	std::vector<std::unique_ptr<Chip8Emu>> instances; // One per thread, reused for every job it runs
+};
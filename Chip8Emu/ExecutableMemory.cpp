@@ -0,0 +1,119 @@
+#include "ExecutableMemory.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+ExecutableMemory::~ExecutableMemory()
+{
+	Release();
+}
+
+#ifdef _WIN32
+bool ExecutableMemory::Allocate(size_t bytes)
+{
+	Release();
+
+	void* pages = VirtualAlloc(nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (!pages)
+	{
+		return false;
+	}
+
+	data = static_cast<unsigned char*>(pages);
+	size = bytes;
+
+	// Fail now rather than on the first translated block if policy forbids executable pages
+	if (!Lock())
+	{
+		Release();
+		return false;
+	}
+	return true;
+}
+
+void ExecutableMemory::Release()
+{
+	if (data)
+	{
+		VirtualFree(data, 0, MEM_RELEASE);
+	}
+	data = nullptr;
+	size = 0;
+}
+
+bool ExecutableMemory::Unlock()
+{
+	DWORD previous;
+	return data && VirtualProtect(data, size, PAGE_READWRITE, &previous);
+}
+
+bool ExecutableMemory::Lock()
+{
+	DWORD previous;
+	return data && VirtualProtect(data, size, PAGE_EXECUTE_READ, &previous) && FlushInstructionCache(GetCurrentProcess(), data, size);
+}
+#else
+bool ExecutableMemory::Allocate(size_t bytes)
+{
+	Release();
+
+	void* pages = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (pages == MAP_FAILED)
+	{
+		return false;
+	}
+
+	data = static_cast<unsigned char*>(pages);
+	size = bytes;
+
+	// Fail now rather than on the first translated block if policy forbids executable pages
+	if (!Lock())
+	{
+		Release();
+		return false;
+	}
+	return true;
+}
+
+void ExecutableMemory::Release()
+{
+	if (data)
+	{
+		munmap(data, size);
+	}
+	data = nullptr;
+	size = 0;
+}
+
+bool ExecutableMemory::Unlock()
+{
+	return data && mprotect(data, size, PROT_READ | PROT_WRITE) == 0;
+}
+
+bool ExecutableMemory::Lock()
+{
+	if (!data || mprotect(data, size, PROT_READ | PROT_EXEC) != 0)
+	{
+		return false;
+	}
+#if defined(__GNUC__) || defined(__clang__)
+	__builtin___clear_cache(reinterpret_cast<char*>(data), reinterpret_cast<char*>(data + size)); // A no-op on x86
+#endif
+	return true;
+}
+#endif
+
+unsigned char* ExecutableMemory::Data() const
+{
+	return data;
+}
+
+size_t ExecutableMemory::Size() const
+{
+	return size;
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <cstddef>
+
+// Anonymous pages for generated machine code. They're never writable and executable at the same time:
+// Unlock makes them read/write while code is emitted, Lock makes them read/execute again before it runs.
+class ExecutableMemory
+{
+public:
+	ExecutableMemory() = default;
+	~ExecutableMemory();
+	ExecutableMemory(const ExecutableMemory&) = delete;
+	ExecutableMemory& operator=(const ExecutableMemory&) = delete;
+
+	bool Allocate(size_t bytes); // Releases any earlier pages, false if the system won't map executable memory
+	void Release();
+
+	bool Unlock(); // Read/write, nothing in the pages may run until Lock
+	bool Lock(); // Read/execute, also makes the new code visible to instruction fetch
+
+	unsigned char* Data() const; // nullptr until allocated
+	size_t Size() const;
+
+private:
+	unsigned char* data = nullptr;
+	size_t size = 0;
+};
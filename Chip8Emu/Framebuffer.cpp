@@ -0,0 +1,32 @@
+#include "Framebuffer.h"
+
+#include <cstring>
+
+void FramebufferExpander::SetColors(uint32_t on, uint32_t off)
+{
+	for (int value = 0; value < 256; value++)
+	{
+		for (int bit = 0; bit < 8; bit++)
+		{
+			lut[value][bit] = (value & (0x80 >> bit)) != 0 ? on : off;
+		}
+	}
+}
+
+void FramebufferExpander::Expand(const uint64_t rows[32], uint32_t dirtyRows, uint32_t* pixels, int pitch) const
+{
+	for (int y = 0; y < 32; y++)
+	{
+		if ((dirtyRows >> y & 1) == 0)
+		{
+			continue;
+		}
+
+		uint32_t* line = pixels + y * pitch;
+		for (int byte = 0; byte < 8; byte++)
+		{
+			unsigned int value = static_cast<unsigned int>(rows[y] >> (56 - byte * 8)) & 0xFF;
+			std::memcpy(line + byte * 8, lut[value], sizeof(lut[value]));
+		}
+	}
+}
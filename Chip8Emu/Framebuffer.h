@@ -0,0 +1,16 @@
+#pragma once
+#include <cstdint>
+
+// Expands the emulator's packed display rows into 32-bit pixels (RGBA, the layout of olc::Pixel),
+// one display byte (8 pixels) at a time through a precomputed lookup table.
+class FramebufferExpander
+{
+public:
+	void SetColors(uint32_t on, uint32_t off);
+
+	// Writes the rows flagged in dirtyRows to pixels, which holds 32 rows of pitch pixels each
+	void Expand(const uint64_t rows[32], uint32_t dirtyRows, uint32_t* pixels, int pitch) const;
+
+private:
+	uint32_t lut[256][8]; // Pixels for every byte value, most significant bit first
+};
@@ -1,13 +1,70 @@
 #define OLC_PGE_APPLICATION
 #include "olcPixelGameEngine.h"
 #include "Chip8Emu.h"
+#include "Framebuffer.h"
+#include "Movie.h"
+#include "Rewind.h"
+#include "RomIndex.h"
+#include "TripleBuffer.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A finished display, handed from the emulation thread to the render thread
+struct Frame
+{
+	uint64_t rows[32];
+};
 
 // Override base class with your custom functionality
 class RenderingEngine : public olc::PixelGameEngine
 {
 public:
-	char* filename;
+	char* filename = nullptr;
 	Chip8Emu emu;
+	FramebufferExpander framebuffer;
+
+	// Emulation runs on its own thread at a fixed instruction rate and publishes finished frames,
+	// so render hitches don't slow the game down and emulation jitter doesn't stall presentation
+	bool threadedEmulation = true;
+	std::thread emulationThread;
+	std::atomic<bool> emulationRunning{ false };
+	TripleBuffer<Frame> frames;
+	uint64_t presentedRows[32] = {};
+	std::atomic<unsigned short> pressedKeys{ 0 }; // Keypad state written by the render thread, bit n is key n
+
+	// Keypad changes from the render thread, stamped with when they happened. The thread that owns emu
+	// takes them at the start of each frame and spreads them over it in proportion to their timing.
+	struct HostKeyEvent
+	{
+		std::chrono::steady_clock::time_point time;
+		unsigned short keys;
+	};
+	std::mutex inputMutex;
+	std::vector<HostKeyEvent> pendingInput;
+	std::vector<HostKeyEvent> takenInput; // Owned by the emulating thread, swapped with pendingInput
+	std::chrono::steady_clock::time_point lastInputTime = std::chrono::steady_clock::now();
+	bool resyncKeys = false; // Set by rewind, which drops queued input and restores old keypad state
+	std::atomic<bool> profileRequested{ false }; // P was pressed, the thread that owns emu prints the profile
+
+	// Holding Backspace steps back one frame per frame through the snapshots taken at the start of each frame
+	RewindBuffer rewind;
+	std::atomic<bool> rewindHeld{ false };
+
+	// --record: every keypad change the game sees, written out as a movie on exit for Chip8Headless --replay
+	const char* movieName = nullptr;
+	Movie movie;
+
+	// Run-ahead: after each real frame the emulator runs this many frames further with the current keys,
+	// presents that future display, and is restored. Page Up/Page Down change it, 0 turns it off.
+	std::atomic<int> runAheadFrames{ 0 };
+	std::chrono::steady_clock::duration runAheadTime{ 0 }; // Accumulated cost, reported every few seconds
+	int runAheadSamples = 0;
 
 	RenderingEngine()
 	{
@@ -21,195 +78,365 @@ public:
 		emu.Start();
 		LoadGame();
 
-		return true;
-	}
-
-	bool OnUserUpdate(float fElapsedTime) override
-	{
-		UpdateInput();
-		emu.Update();
+		framebuffer.SetColors(olc::Pixel(255, 255, 255).n, olc::Pixel(0, 0, 0).n);
 
-		if (emu.drawFlag)
+		if (threadedEmulation)
 		{
-//#pragma omp parallel for // Slower for some reason
-			for (int i = 0; i < 64 * 32; i++)
-			{
-				if (emu.gfx[i])
-				{
-					Draw(i % 64, i / 64, olc::Pixel(255, 255, 255));
-				}
-				else
-				{
-					Draw(i % 64, i / 64, olc::Pixel(0, 0, 0));
-				}
-			}
-
-			emu.drawFlag = false;
+			emulationRunning = true;
+			emulationThread = std::thread(&RenderingEngine::EmulationLoop, this);
 		}
 
 		return true;
 	}
 
-	void LoadGame()
+	bool OnUserDestroy() override
 	{
-		std::ifstream romfile;
-		if (filename)
-		{
-			romfile.open(filename, std::ios::binary);
-			if (!romfile)
-			{
-				std::cout << "Failed to open the file, falling back to Invaders.ch8" << std::endl;
-				romfile.open("Invaders.ch8", std::ios::binary);
-			}
-		}
-		else
+		if (emulationThread.joinable())
 		{
-			std::cout << "No file provided, falling back to Invaders.ch8" << std::endl;
-			romfile.open("Invaders.ch8", std::ios::binary);
+			emulationRunning = false;
+			emulationThread.join();
 		}
-
-		char c;
-		int i = 0;
-		while (romfile.get(c))
+#ifdef CHIP8_PROFILE
+		emu.PrintProfile(std::cout);
+#endif
+		if (movieName)
 		{
-			//std::cout << std::hex << (uint16_t)c << std::dec << std::endl;
-			emu.memory[i + 0x200] = c;
-			i++;
+			SaveMovie();
 		}
+		return true;
 	}
 
-	void UpdateInput()
+	bool OnUserUpdate(float fElapsedTime) override
 	{
-		// Input handling
-		if (GetKey(olc::Key::K0).bPressed)
-		{
-			emu.key[0] = 1;
-		}
-		if (GetKey(olc::Key::K1).bPressed)
+		UpdateInput();
+
+		if (threadedEmulation)
 		{
-			emu.key[1] = 1;
+			PresentLatestFrame();
+			return true;
 		}
-		if (GetKey(olc::Key::K2).bPressed)
+
+		uint64_t aheadRows[32];
+		bool ranAhead = false;
+		if (!StepBack())
 		{
-			emu.key[2] = 1;
+			ApplyInput();
+			TakeSnapshot();
+			AdvanceFrame();
+			PrintProfileIfRequested();
+			ranAhead = RunAhead(aheadRows);
 		}
-		if (GetKey(olc::Key::K3).bPressed)
+
+		if (ranAhead)
 		{
-			emu.key[3] = 1;
+			PresentRows(aheadRows);
 		}
-		if (GetKey(olc::Key::K4).bPressed)
+		else if (emu.drawFlag)
 		{
-			emu.key[4] = 1;
+			PresentRows(emu.gfxRows);
 		}
-		if (GetKey(olc::Key::K5).bPressed)
+		emu.drawFlag = false;
+
+		return true;
+	}
+
+	// Emulation thread: runs one 60 Hz frame (up to the next timer tick) at a time on the wall clock,
+	// publishing the display whenever the frame drew something or ran ahead
+	void EmulationLoop()
+	{
+		using clock = std::chrono::steady_clock;
+		const clock::duration framePeriod = std::chrono::microseconds(1000000 / 60);
+
+		clock::time_point nextFrame = clock::now();
+		while (emulationRunning)
 		{
-			emu.key[5] = 1;
+			uint64_t aheadRows[32];
+			bool ranAhead = false;
+			if (!StepBack())
+			{
+				ApplyInput();
+				TakeSnapshot();
+				AdvanceFrame();
+				PrintProfileIfRequested();
+				ranAhead = RunAhead(aheadRows);
+			}
+
+			if (ranAhead || emu.drawFlag)
+			{
+				Frame& frame = frames.WriteBuffer();
+				std::memcpy(frame.rows, ranAhead ? aheadRows : emu.gfxRows, sizeof(frame.rows));
+				frames.Publish();
+			}
+			emu.drawFlag = false;
+
+			nextFrame += framePeriod;
+			clock::time_point now = clock::now();
+			if (now - nextFrame > framePeriod * 10)
+			{
+				nextFrame = now; // Fell far behind (debugger, suspended process), don't try to catch up
+			}
+			std::this_thread::sleep_until(nextFrame);
 		}
-		if (GetKey(olc::Key::K6).bPressed)
+	}
+
+	// Render thread: takes the newest published frame, if any, and expands the rows that differ from what's on screen
+	void PresentLatestFrame()
+	{
+		if (!frames.Consume())
 		{
-			emu.key[6] = 1;
+			return;
 		}
-		if (GetKey(olc::Key::K7).bPressed)
+
+		PresentRows(frames.ReadBuffer().rows);
+	}
+
+	// Expands the rows that differ from what's on screen, straight into the draw target's pixels rather than
+	// through Draw(). Diffing against what was presented covers every source of frames alike: emulated,
+	// run-ahead, rewound and published by the emulation thread.
+	void PresentRows(const uint64_t rows[32])
+	{
+		uint32_t changedRows = 0;
+		for (int y = 0; y < 32; y++)
 		{
-			emu.key[7] = 1;
+			if (rows[y] != presentedRows[y])
+			{
+				changedRows |= 1u << y;
+				presentedRows[y] = rows[y];
+			}
 		}
-		if (GetKey(olc::Key::K8).bPressed)
+
+		olc::Sprite* target = GetDrawTarget();
+		framebuffer.Expand(presentedRows, changedRows, reinterpret_cast<uint32_t*>(target->GetData()), target->width);
+	}
+
+	// One frame of emulation: a 60 Hz timer period on the emulation thread, one Update() otherwise
+	void AdvanceFrame()
+	{
+		if (threadedEmulation)
 		{
-			emu.key[8] = 1;
+			emu.RunCycles(emu.CyclesUntilTimerTick());
 		}
-		if (GetKey(olc::Key::K9).bPressed)
+		else
 		{
-			emu.key[9] = 1;
+			emu.Update();
 		}
-		if (GetKey(olc::Key::A).bPressed)
+	}
+
+	// Runs runAheadFrames frames into the future, copies that display to rows and restores the present.
+	// Returns false (and leaves rows alone) when run-ahead is off.
+	bool RunAhead(uint64_t rows[32])
+	{
+		int ahead = runAheadFrames.load(std::memory_order_relaxed);
+		if (ahead <= 0)
 		{
-			emu.key[0xA] = 1;
+			return false;
 		}
-		if (GetKey(olc::Key::B).bPressed)
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		Chip8State present;
+		emu.SaveState(present);
+		for (int i = 0; i < ahead; i++)
 		{
-			emu.key[0xB] = 1;
+			AdvanceFrame();
 		}
-		if (GetKey(olc::Key::C).bPressed)
+		std::memcpy(rows, emu.gfxRows, sizeof(emu.gfxRows));
+		emu.LoadState(present);
+		runAheadTime += std::chrono::steady_clock::now() - start;
+
+		if (++runAheadSamples == 300)
 		{
-			emu.key[0xC] = 1;
+			double microseconds = std::chrono::duration<double, std::micro>(runAheadTime).count() / runAheadSamples;
+			std::cout << "Run-ahead " << ahead << ": " << microseconds << " us per frame ("
+				<< microseconds / (1e6 / 60) * 100 << "% of a 60 Hz frame)" << std::endl;
+			runAheadTime = std::chrono::steady_clock::duration::zero();
+			runAheadSamples = 0;
 		}
-		if (GetKey(olc::Key::D).bPressed)
+		return true;
+	}
+
+	// Queues the keypad changes made since the last frame at the same relative points of this frame:
+	// a change halfway between the previous call and now lands halfway through the frame about to run.
+	// Input still arrives one frame late, but a tap shorter than a frame now reaches the game.
+	void ApplyInput()
+	{
+		takenInput.clear();
 		{
-			emu.key[0xD] = 1;
+			std::lock_guard<std::mutex> lock(inputMutex);
+			takenInput.swap(pendingInput);
 		}
-		if (GetKey(olc::Key::E).bPressed)
+
+		std::chrono::steady_clock::time_point previous = lastInputTime;
+		lastInputTime = std::chrono::steady_clock::now();
+		double period = std::chrono::duration<double>(lastInputTime - previous).count();
+		unsigned long long frameStart = emu.GetCycleCount();
+		int frameCycles = emu.CyclesUntilTimerTick();
+
+		if (resyncKeys && takenInput.empty())
 		{
-			emu.key[0xE] = 1;
+			QueueKeys(frameStart, pressedKeys.load(std::memory_order_relaxed));
 		}
-		if (GetKey(olc::Key::F).bPressed)
+		resyncKeys = false;
+
+		for (const HostKeyEvent& event : takenInput)
 		{
-			emu.key[0xF] = 1;
+			double position = period > 0.0 ? std::chrono::duration<double>(event.time - previous).count() / period : 0.0;
+			int offset = std::min(frameCycles - 1, std::max(0, static_cast<int>(position * frameCycles)));
+			QueueKeys(frameStart + offset, event.keys);
 		}
+	}
 
-		// Up
-		if (GetKey(olc::Key::K0).bReleased)
+	// A full queue is flushed by running up to its next event, which is never past this one's cycle
+	void QueueKeys(unsigned long long cycle, unsigned short keys)
+	{
+		unsigned long long applied;
+		while (!emu.QueueKeys(cycle, keys, applied))
 		{
-			emu.key[0] = 0;
+			emu.RunCycles(emu.CyclesUntilKeyEvent());
 		}
-		if (GetKey(olc::Key::K1).bReleased)
+		if (movieName)
 		{
-			emu.key[1] = 0;
+			movie.Record(applied, keys);
 		}
-		if (GetKey(olc::Key::K2).bReleased)
+	}
+
+	void SaveMovie()
+	{
+		movie.romHash = emu.GetRomHash();
+		movie.seed = emu.rngSeed;
+		movie.instructionsPerSecond = emu.GetInstructionsPerSecond();
+		movie.length = emu.GetCycleCount();
+		movie.finalFrameHash = emu.FrameHash();
+		movie.Truncate(movie.length); // Queued but never reached
+		if (movie.Save(movieName))
 		{
-			emu.key[2] = 0;
+			std::cout << "Recorded " << movie.length << " cycles to " << movieName << std::endl;
 		}
-		if (GetKey(olc::Key::K3).bReleased)
+		else
 		{
-			emu.key[3] = 0;
+			std::cout << "Failed to write " << movieName << std::endl;
 		}
-		if (GetKey(olc::Key::K4).bReleased)
+	}
+
+	void TakeSnapshot()
+	{
+		Chip8State state;
+		emu.SaveState(state);
+		rewind.Push(state);
+	}
+
+	// Restores the previous frame's snapshot while rewind is held, returns false when the game should run instead
+	bool StepBack()
+	{
+		if (!rewindHeld)
 		{
-			emu.key[4] = 0;
+			return false;
 		}
-		if (GetKey(olc::Key::K5).bReleased)
+
+		Chip8State state;
+		if (rewind.Pop(state))
 		{
-			emu.key[5] = 0;
+			emu.LoadState(state); // Sets drawFlag, PresentRows then redraws the rows that differ from the screen
+			emu.ClearKeyEvents(); // The rewound input never happened
+			movie.Truncate(emu.GetCycleCount());
+			resyncKeys = true;
 		}
-		if (GetKey(olc::Key::K6).bReleased)
+		return true;
+	}
+
+	void PrintProfileIfRequested()
+	{
+		if (profileRequested.exchange(false))
 		{
-			emu.key[6] = 0;
+			emu.PrintProfile(std::cout);
 		}
-		if (GetKey(olc::Key::K7).bReleased)
+	}
+
+	void LoadGame()
+	{
+		if (filename)
 		{
-			emu.key[7] = 0;
+			ConfigureForRom(filename);
+			if (!emu.LoadRom(filename))
+			{
+				std::cout << "Failed to load the file (missing, or too big for CHIP-8 memory), falling back to Invaders.ch8" << std::endl;
+				ConfigureForRom("Invaders.ch8");
+				emu.LoadRom("Invaders.ch8");
+			}
 		}
-		if (GetKey(olc::Key::K8).bReleased)
+		else
 		{
-			emu.key[8] = 0;
+			std::cout << "No file provided, falling back to Invaders.ch8" << std::endl;
+			ConfigureForRom("Invaders.ch8");
+			emu.LoadRom("Invaders.ch8");
 		}
-		if (GetKey(olc::Key::K9).bReleased)
+	}
+
+	// Sets the speed the ROM's entry in its directory's index calls for. The ROM is only analyzed when
+	// it's new to the index or changed since; the index is left as it is (Chip8Headless --scan writes it).
+	void ConfigureForRom(const char* rom)
+	{
+		std::filesystem::path path(rom);
+		RomIndex index;
+		const RomInfo* info = index.Refresh(path.has_parent_path() ? path.parent_path().string() : ".", path.filename().string());
+		if (!info)
 		{
-			emu.key[9] = 0;
+			return;
 		}
-		if (GetKey(olc::Key::A).bReleased)
+
+		info->Apply(emu);
+		std::cout << "Platform: " << RomIndex::PlatformName(info->platform) << ", " << info->instructionsPerSecond << " instructions/sec" << std::endl;
+		if (info->platform != Platform::Chip8)
 		{
-			emu.key[0xA] = 0;
+			std::cout << "Only CHIP-8 instructions are emulated, this ROM may not run correctly" << std::endl;
 		}
-		if (GetKey(olc::Key::B).bReleased)
+		else if (info->UnsupportedQuirks() != 0)
 		{
-			emu.key[0xB] = 0;
+			std::cout << "The ROM may rely on original CHIP-8 behaviour that isn't emulated (quirks 0x" << std::hex << info->UnsupportedQuirks() << std::dec << ")" << std::endl;
 		}
-		if (GetKey(olc::Key::C).bReleased)
+	}
+
+	void UpdateInput()
+	{
+		// Keypad, key n on the host key labelled n. Each change is timestamped so the emulator can
+		// place it at the matching instruction rather than at the start of the next frame.
+		static const olc::Key keypad[16] = { olc::Key::K0, olc::Key::K1, olc::Key::K2, olc::Key::K3,
+			olc::Key::K4, olc::Key::K5, olc::Key::K6, olc::Key::K7, olc::Key::K8, olc::Key::K9,
+			olc::Key::A, olc::Key::B, olc::Key::C, olc::Key::D, olc::Key::E, olc::Key::F };
+		unsigned short keys = pressedKeys.load(std::memory_order_relaxed);
+		for (int i = 0; i < 16; i++)
+		{
+			olc::HWButton button = GetKey(keypad[i]);
+			if (button.bPressed)
+			{
+				keys |= static_cast<unsigned short>(1 << i);
+			}
+			if (button.bReleased)
+			{
+				keys &= static_cast<unsigned short>(~(1 << i));
+			}
+		}
+		if (keys != pressedKeys.load(std::memory_order_relaxed))
 		{
-			emu.key[0xC] = 0;
+			std::lock_guard<std::mutex> lock(inputMutex);
+			pendingInput.push_back({ std::chrono::steady_clock::now(), keys });
+			pressedKeys = keys;
 		}
-		if (GetKey(olc::Key::D).bReleased)
+
+		if (GetKey(olc::Key::P).bPressed)
 		{
-			emu.key[0xD] = 0;
+			profileRequested = true;
 		}
-		if (GetKey(olc::Key::E).bReleased)
+
+		rewindHeld = GetKey(olc::Key::BACK).bHeld;
+
+		const int maxRunAhead = 8;
+		if (GetKey(olc::Key::PGUP).bPressed && runAheadFrames < maxRunAhead)
 		{
-			emu.key[0xE] = 0;
+			std::cout << "Run-ahead: " << ++runAheadFrames << " frames" << std::endl;
 		}
-		if (GetKey(olc::Key::F).bReleased)
+		if (GetKey(olc::Key::PGDN).bPressed && runAheadFrames > 0)
 		{
-			emu.key[0xF] = 0;
+			std::cout << "Run-ahead: " << --runAheadFrames << " frames" << std::endl;
 		}
 	}
 };
@@ -228,6 +455,15 @@ int main(int argc, char* argv[])
 		std::cout << "Loading: " << engine.filename << std::endl;
 	}
 
+	for (int i = 2; i + 1 < argc; i += 2)
+	{
+		if (std::strcmp(argv[i], "--record") == 0)
+		{
+			engine.movieName = argv[i + 1];
+			std::cout << "Recording input to " << engine.movieName << std::endl;
+		}
+	}
+
 	if (engine.Construct(64, 32, 4, 4, false, false))
 		engine.Start();
 	return 0;
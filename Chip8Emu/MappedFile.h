@@ -0,0 +1,26 @@
+#pragma once
+#include <cstddef>
+
+// Read-only view of a whole file. The file is memory-mapped rather than read, so opening it costs
+// one system call sequence and no copy; pages are only brought in as they're touched.
+class MappedFile
+{
+public:
+	MappedFile() = default;
+	~MappedFile();
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool Open(const char* filename); // Closes any file already open, false if it can't be opened or mapped
+	void Close();
+
+	const unsigned char* Data() const; // nullptr for an empty file
+	size_t Size() const;
+
+private:
+	const unsigned char* data = nullptr;
+	size_t size = 0;
+#ifdef _WIN32
+	void* mapping = nullptr; // File mapping HANDLE, kept until the view is unmapped
+#endif
+};
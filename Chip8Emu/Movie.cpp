@@ -0,0 +1,149 @@
+#include "Movie.h"
+
+#include <cstring>
+#include <fstream>
+
+// File layout, integers little-endian:
+//   "C8MV", version (4), ROM hash (8), seed (8), instructions per second (4), length (8), final frame hash (8),
+//   event count (4), then per event the cycles since the previous event as a LEB128 varint and the keys (2).
+static const uint32_t movieVersion = 1;
+
+static void WriteInteger(std::ostream& out, uint64_t value, int size)
+{
+	for (int i = 0; i < size; i++)
+	{
+		out.put(static_cast<char>(value >> (i * 8)));
+	}
+}
+
+static uint64_t ReadInteger(std::istream& in, int size)
+{
+	uint64_t value = 0;
+	for (int i = 0; i < size; i++)
+	{
+		value |= static_cast<uint64_t>(static_cast<unsigned char>(in.get())) << (i * 8);
+	}
+	return value;
+}
+
+static void WriteVarint(std::ostream& out, uint64_t value)
+{
+	do
+	{
+		unsigned char byte = value & 0x7F;
+		value >>= 7;
+		out.put(static_cast<char>(byte | (value != 0 ? 0x80 : 0)));
+	} while (value != 0);
+}
+
+static uint64_t ReadVarint(std::istream& in)
+{
+	uint64_t value = 0;
+	for (int shift = 0; shift < 64; shift += 7)
+	{
+		int byte = in.get();
+		if (byte == std::char_traits<char>::eof())
+		{
+			break;
+		}
+		value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+		if ((byte & 0x80) == 0)
+		{
+			break;
+		}
+	}
+	return value;
+}
+
+void Movie::Record(unsigned long long cycle, unsigned short keys)
+{
+	unsigned short current = events.empty() ? 0 : events.back().keys;
+	if (keys == current)
+	{
+		return;
+	}
+
+	// Several changes within one cycle only leave the last one
+	if (!events.empty() && events.back().cycle == cycle)
+	{
+		events.pop_back();
+		if (keys == (events.empty() ? 0 : events.back().keys))
+		{
+			return;
+		}
+	}
+	events.push_back({ cycle, keys });
+}
+
+void Movie::Truncate(unsigned long long cycle)
+{
+	while (!events.empty() && events.back().cycle >= cycle)
+	{
+		events.pop_back();
+	}
+}
+
+bool Movie::Save(const char* filename) const
+{
+	std::ofstream file(filename, std::ios::binary);
+	if (!file)
+	{
+		return false;
+	}
+
+	file.write("C8MV", 4);
+	WriteInteger(file, movieVersion, 4);
+	WriteInteger(file, romHash, 8);
+	WriteInteger(file, seed, 8);
+	WriteInteger(file, static_cast<uint32_t>(instructionsPerSecond), 4);
+	WriteInteger(file, length, 8);
+	WriteInteger(file, finalFrameHash, 8);
+	WriteInteger(file, events.size(), 4);
+
+	unsigned long long previous = 0;
+	for (const KeyEvent& event : events)
+	{
+		WriteVarint(file, event.cycle - previous);
+		WriteInteger(file, event.keys, 2);
+		previous = event.cycle;
+	}
+	return static_cast<bool>(file);
+}
+
+// Leaves the movie untouched and returns false if the file is missing, of another version or cut short
+bool Movie::Load(const char* filename)
+{
+	std::ifstream file(filename, std::ios::binary);
+	char magic[4];
+	if (!file.read(magic, 4) || std::memcmp(magic, "C8MV", 4) != 0 || ReadInteger(file, 4) != movieVersion)
+	{
+		return false;
+	}
+
+	Movie movie;
+	movie.romHash = ReadInteger(file, 8);
+	movie.seed = ReadInteger(file, 8);
+	movie.instructionsPerSecond = static_cast<int>(ReadInteger(file, 4));
+	movie.length = ReadInteger(file, 8);
+	movie.finalFrameHash = ReadInteger(file, 8);
+	uint64_t count = ReadInteger(file, 4);
+	if (!file || movie.instructionsPerSecond <= 0)
+	{
+		return false;
+	}
+
+	unsigned long long cycle = 0;
+	for (uint64_t i = 0; i < count && file; i++)
+	{
+		cycle += ReadVarint(file);
+		unsigned short keys = static_cast<unsigned short>(ReadInteger(file, 2));
+		movie.events.push_back({ cycle, keys });
+	}
+	if (!file)
+	{
+		return false;
+	}
+
+	*this = movie;
+	return true;
+}
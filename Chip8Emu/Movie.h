@@ -0,0 +1,25 @@
+#pragma once
+#include "Chip8Emu.h"
+
+#include <cstdint>
+#include <vector>
+
+// A recorded run: every keypad change keyed by instruction count, plus what's needed to start the run
+// the same way (ROM, seed, speed). Queueing the events on a Chip8Emu (QueueKeys) reproduces the run
+// bit for bit, at whatever speed the host allows.
+class Movie
+{
+public:
+	uint64_t romHash = 0; // Chip8Emu::GetRomHash of the ROM it was recorded on
+	uint64_t seed = 0;
+	int instructionsPerSecond = 600;
+	unsigned long long length = 0; // Cycles recorded
+	uint64_t finalFrameHash = 0; // Chip8Emu::FrameHash at length, lets a replay confirm it ended up in the same place
+	std::vector<KeyEvent> events; // Ordered by cycle
+
+	void Record(unsigned long long cycle, unsigned short keys); // Adds an event if keys differ from the current state
+	void Truncate(unsigned long long cycle); // Drops events from cycle on, e.g. when the recording is rewound
+
+	bool Save(const char* filename) const;
+	bool Load(const char* filename);
+};
@@ -0,0 +1,209 @@
+#include "Rewind.h"
+
+#include <cstdint>
+#include <cstring>
+
+// Encoded snapshot: a sequence of (unchanged byte count, changed byte count, changed bytes XOR base) runs
+// over the raw bytes of a Chip8State, counts as LEB128 varints. Keyframes are encoded against all zeroes.
+
+static size_t WriteVarint(unsigned char* out, size_t value)
+{
+	size_t written = 0;
+	do
+	{
+		unsigned char byte = value & 0x7F;
+		value >>= 7;
+		out[written++] = static_cast<unsigned char>(byte | (value != 0 ? 0x80 : 0));
+	} while (value != 0);
+	return written;
+}
+
+static size_t ReadVarint(const unsigned char*& in)
+{
+	size_t value = 0;
+	for (int shift = 0; ; shift += 7)
+	{
+		unsigned char byte = *in++;
+		value |= static_cast<size_t>(byte & 0x7F) << shift;
+		if ((byte & 0x80) == 0)
+		{
+			return value;
+		}
+	}
+}
+
+static const Chip8State zeroState = {}; // Base that keyframes are encoded against
+
+static size_t Encode(const unsigned char* base, const unsigned char* current, size_t size, unsigned char* out)
+{
+	size_t written = 0;
+	size_t i = 0;
+	while (i < size)
+	{
+		// Unchanged bytes, a word at a time while possible
+		size_t unchangedStart = i;
+		while (i + 8 <= size && std::memcmp(current + i, base + i, 8) == 0)
+		{
+			i += 8;
+		}
+		while (i < size && current[i] == base[i])
+		{
+			i++;
+		}
+		size_t unchanged = i - unchangedStart;
+
+		size_t changedStart = i;
+		while (i < size && current[i] != base[i])
+		{
+			i++;
+		}
+		size_t changed = i - changedStart;
+
+		written += WriteVarint(out + written, unchanged);
+		written += WriteVarint(out + written, changed);
+		for (size_t j = changedStart; j < i; j++)
+		{
+			out[written++] = static_cast<unsigned char>(current[j] ^ base[j]);
+		}
+	}
+	return written;
+}
+
+RewindBuffer::RewindBuffer(size_t capacityBytes, int keyframeInterval)
+	: storage(capacityBytes), scratch(sizeof(Chip8State) * 2 + 16), keyframeInterval(keyframeInterval), sinceKeyframe(0), bytesUsed(0)
+{
+}
+
+void RewindBuffer::Push(const Chip8State& state)
+{
+	bool isKeyframe = records.empty() || sinceKeyframe >= keyframeInterval;
+	const unsigned char* base = reinterpret_cast<const unsigned char*>(isKeyframe ? &zeroState : &keyframe);
+	size_t size = Encode(base, reinterpret_cast<const unsigned char*>(&state), sizeof(Chip8State), scratch.data());
+	if (size > storage.size())
+	{
+		return;
+	}
+
+	// Records are laid out back to back and wrap to the start when the next one doesn't fit before the end.
+	// Whatever the new record would overwrite is the oldest data, so it goes first.
+	size_t end = records.empty() ? 0 : records.back().offset + records.back().size;
+	size_t offset = end;
+	if (offset + size > storage.size())
+	{
+		// Records stored past the end are older than everything at the start
+		while (!records.empty() && records.front().offset >= end)
+		{
+			EvictOldest();
+		}
+		offset = 0;
+	}
+	while (!records.empty() && records.front().offset < offset + size && records.front().offset + records.front().size > offset)
+	{
+		EvictOldest();
+	}
+
+	if (records.empty() && !isKeyframe)
+	{
+		// The keyframe this delta was relative to had to go as well
+		Push(state);
+		return;
+	}
+
+	std::memcpy(storage.data() + offset, scratch.data(), size);
+	records.push_back({ offset, size, isKeyframe });
+	bytesUsed += size;
+
+	if (isKeyframe)
+	{
+		keyframe = state;
+		sinceKeyframe = 1;
+	}
+	else
+	{
+		sinceKeyframe++;
+	}
+}
+
+bool RewindBuffer::Pop(Chip8State& state)
+{
+	if (records.empty())
+	{
+		return false;
+	}
+
+	Record newest = records.back();
+	records.pop_back();
+	bytesUsed -= newest.size;
+
+	if (!newest.keyframe)
+	{
+		DecodeRecord(newest, &keyframe, state);
+		sinceKeyframe--;
+		return true;
+	}
+
+	// Popping a keyframe: the remaining newest deltas belong to the keyframe before it
+	state = keyframe;
+	sinceKeyframe = 0;
+	for (auto record = records.rbegin(); record != records.rend(); ++record)
+	{
+		sinceKeyframe++;
+		if (record->keyframe)
+		{
+			DecodeRecord(*record, nullptr, keyframe);
+			break;
+		}
+	}
+	return true;
+}
+
+void RewindBuffer::Clear()
+{
+	records.clear();
+	sinceKeyframe = 0;
+	bytesUsed = 0;
+}
+
+size_t RewindBuffer::Count() const
+{
+	return records.size();
+}
+
+size_t RewindBuffer::BytesUsed() const
+{
+	return bytesUsed;
+}
+
+// Drops the oldest keyframe and the deltas that can't be decoded without it
+void RewindBuffer::EvictOldest()
+{
+	do
+	{
+		bytesUsed -= records.front().size;
+		records.pop_front();
+	} while (!records.empty() && !records.front().keyframe);
+
+	if (records.empty())
+	{
+		sinceKeyframe = 0;
+	}
+}
+
+void RewindBuffer::DecodeRecord(const Record& record, const Chip8State* base, Chip8State& state) const
+{
+	state = base ? *base : zeroState;
+	unsigned char* out = reinterpret_cast<unsigned char*>(&state);
+
+	const unsigned char* in = storage.data() + record.offset;
+	const unsigned char* inEnd = in + record.size;
+	size_t position = 0;
+	while (in < inEnd)
+	{
+		position += ReadVarint(in);
+		size_t changed = ReadVarint(in);
+		for (size_t i = 0; i < changed; i++)
+		{
+			out[position++] ^= *in++;
+		}
+	}
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include "Chip8Emu.h"
+
+#include <cstddef>
+#include <deque>
+#include <vector>
+
+// Ring buffer of recent Chip8States for real-time rewind. Every keyframeInterval-th snapshot is a keyframe,
+// the others are stored as the XOR against the last keyframe. Both are run-length encoded on the zero bytes
+// of that XOR, so a frame that changed a handful of registers and display rows costs a few dozen bytes.
+// When the buffer is full the oldest keyframe is dropped together with the deltas that depend on it.
+class RewindBuffer
+{
+public:
+	explicit RewindBuffer(size_t capacityBytes = 512 * 1024, int keyframeInterval = 60);
+
+	void Push(const Chip8State& state);
+	bool Pop(Chip8State& state); // Removes the newest snapshot and returns it, false if there is none
+	void Clear();
+
+	size_t Count() const;
+	size_t BytesUsed() const;
+
+private:
+	struct Record
+	{
+		size_t offset; // Position of the encoded bytes in storage
+		size_t size;
+		bool keyframe;
+	};
+
+	void EvictOldest();
+	void DecodeRecord(const Record& record, const Chip8State* base, Chip8State& state) const;
+
+	std::vector<unsigned char> storage;
+	std::vector<unsigned char> scratch; // Encoder output, sized for the worst case so Push never allocates
+	std::deque<Record> records; // Oldest first
+	Chip8State keyframe; // Decoded keyframe the newest deltas are relative to
+	int keyframeInterval;
+	int sinceKeyframe; // Snapshots pushed since the newest keyframe, including it
+	size_t bytesUsed;
+};
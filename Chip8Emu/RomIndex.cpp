@@ -0,0 +1,379 @@
+#include "RomIndex.h"
+#include "MappedFile.h"
+
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+const char* const RomIndex::fileName = "chip8index.txt";
+
+// Chip8Emu shifts VX in place, leaves I and VF alone, jumps to NNN + V0 and clips sprites: none of the RomQuirks
+static const uint32_t coreQuirks = 0;
+
+// Instruction-level behaviours each platform expects
+static uint32_t PlatformQuirks(Platform platform)
+{
+	switch (platform)
+	{
+	case Platform::SuperChip: return QuirkJumpVX;
+	case Platform::XoChip: return QuirkShiftVY | QuirkLoadStoreIncrement | QuirkWrap;
+	default: return 0; // The behaviour most CHIP-8 ROMs are written against, which is what the core does
+	}
+}
+
+static std::string Extension(const std::string& file)
+{
+	std::string extension = std::filesystem::path(file).extension().string();
+	std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+	return extension;
+}
+
+static bool IsRomFile(const std::string& file)
+{
+	std::string extension = Extension(file);
+	return extension == ".ch8" || extension == ".c8" || extension == ".sc8" || extension == ".xo8";
+}
+
+void RomInfo::Apply(Chip8Emu& emu) const
+{
+	emu.SetInstructionsPerSecond(instructionsPerSecond);
+	emu.cycleUntilDraw = cycleUntilDraw;
+}
+
+uint32_t RomInfo::UnsupportedQuirks() const
+{
+	return quirks & ~coreQuirks;
+}
+
+// Traces the instructions reachable from 0x200 and looks for ones only SCHIP or XO-CHIP have. Only reachable code
+// counts, since sprite data can look like anything. Jumps and calls are followed, skips take both paths, and
+// returns, exits and BNNN (whose target depends on V0) end a path. An explicit .sc8/.xo8 extension or a ROM too big
+// for CHIP-8 memory settles the platform without looking.
+RomInfo RomIndex::Analyze(const std::string& file, const unsigned char* data, size_t size)
+{
+	RomInfo info;
+	info.file = file;
+	info.hash = Chip8Emu::HashBytes(data, size);
+	info.size = size;
+
+	int superChipHits = 0;
+	int xoChipHits = 0;
+	uint32_t uses = 0; // Quirk bits of the instructions present
+	std::vector<bool> visited(size, false);
+	std::vector<size_t> paths = { 0 }; // ROM offsets still to trace
+	while (!paths.empty())
+	{
+		size_t offset = paths.back();
+		paths.pop_back();
+		while (offset + 1 < size && !visited[offset])
+		{
+			visited[offset] = true;
+			unsigned short op = static_cast<unsigned short>(data[offset] << 8 | data[offset + 1]);
+			size_t next = offset + 2;
+			size_t target = (op & 0x0FFF) >= 0x200 ? (op & 0x0FFF) - 0x200 : size; // For 1NNN and 2NNN
+			bool ends = false;
+			switch (op >> 12)
+			{
+			case 0x0:
+				ends = op == 0x00EE || op == 0x00FD; // Return, exit
+				if ((op & 0xFFF0) == 0x00C0 || (op >= 0x00FB && op <= 0x00FF))
+				{
+					superChipHits++; // Scrolling, exit, lores/hires
+				}
+				else if ((op & 0xFFF0) == 0x00D0)
+				{
+					xoChipHits++; // Scroll up
+				}
+				break;
+			case 0x1:
+				next = target;
+				break;
+			case 0x2:
+				paths.push_back(target);
+				break;
+			case 0x3:
+			case 0x4:
+			case 0x9:
+			case 0xE:
+				paths.push_back(offset + 4);
+				break;
+			case 0x5:
+				if ((op & 0xF) == 0x2 || (op & 0xF) == 0x3)
+				{
+					xoChipHits++; // Register range save/load
+				}
+				else
+				{
+					paths.push_back(offset + 4);
+				}
+				break;
+			case 0x8:
+				if ((op & 0xF) >= 0x1 && (op & 0xF) <= 0x3)
+				{
+					uses |= QuirkVFReset;
+				}
+				else if ((op & 0xF) == 0x6 || (op & 0xF) == 0xE)
+				{
+					uses |= QuirkShiftVY;
+				}
+				break;
+			case 0xB:
+				uses |= QuirkJumpVX;
+				ends = true;
+				break;
+			case 0xD:
+				uses |= QuirkWrap;
+				if ((op & 0xF) == 0)
+				{
+					superChipHits++; // 16x16 sprite
+				}
+				break;
+			case 0xF:
+				if (op == 0xF000 || op == 0xF002 || (op & 0xF0FF) == 0xF001 || (op & 0xFF) == 0x3A)
+				{
+					xoChipHits++; // Long I, audio pattern, plane select, pitch
+					if (op == 0xF000)
+					{
+						next = offset + 4; // Followed by the 16-bit address
+					}
+				}
+				else if ((op & 0xFF) == 0x30 || (op & 0xFF) == 0x75 || (op & 0xFF) == 0x85)
+				{
+					superChipHits++; // Big font, flag registers
+				}
+				else if ((op & 0xFF) == 0x55 || (op & 0xFF) == 0x65)
+				{
+					uses |= QuirkLoadStoreIncrement;
+				}
+				break;
+			}
+			if (ends)
+			{
+				break;
+			}
+			offset = next;
+		}
+	}
+
+	std::string extension = Extension(file);
+	if (extension == ".xo8" || size > Chip8Emu::MaxRomSize || xoChipHits > 0)
+	{
+		info.platform = Platform::XoChip;
+	}
+	else if (extension == ".sc8" || superChipHits > 0)
+	{
+		info.platform = Platform::SuperChip;
+	}
+	info.quirks = PlatformQuirks(info.platform) & uses;
+
+	// CHIP-8 games are timed for roughly 10 instructions a frame, SCHIP ones for the faster HP48 and
+	// XO-CHIP ones for Octo's 1000 a frame. The latter two draw many sprites a frame, so running to
+	// the next draw would stall them.
+	switch (info.platform)
+	{
+	case Platform::Chip8:
+		info.instructionsPerSecond = 600;
+		info.cycleUntilDraw = true;
+		break;
+	case Platform::SuperChip:
+		info.instructionsPerSecond = 1800;
+		info.cycleUntilDraw = false;
+		break;
+	case Platform::XoChip:
+		info.instructionsPerSecond = 60000;
+		info.cycleUntilDraw = false;
+		break;
+	}
+	return info;
+}
+
+const char* RomIndex::PlatformName(Platform platform)
+{
+	switch (platform)
+	{
+	case Platform::SuperChip: return "schip";
+	case Platform::XoChip: return "xochip";
+	default: return "chip8";
+	}
+}
+
+// Layout: comment lines starting with #, then one ROM per line:
+// hash size modified platform quirks instructionsPerSecond cycleUntilDraw file
+bool RomIndex::Load(const std::string& indexDirectory)
+{
+	directory = indexDirectory;
+	indexed = true;
+	roms.clear();
+	changed = false;
+
+	std::ifstream index(std::filesystem::path(directory) / fileName);
+	if (!index)
+	{
+		return false;
+	}
+
+	std::string line;
+	while (std::getline(index, line))
+	{
+		if (line.empty() || line[0] == '#')
+		{
+			continue;
+		}
+
+		std::istringstream fields(line);
+		RomInfo info;
+		std::string platform;
+		if (!(fields >> std::hex >> info.hash >> std::dec >> info.size >> info.modified >> platform >> std::hex >> info.quirks
+			>> std::dec >> info.instructionsPerSecond >> info.cycleUntilDraw) || !std::getline(fields >> std::ws, info.file) || info.file.empty())
+		{
+			changed = true; // Dropped, the file gets analyzed again
+			continue;
+		}
+		info.platform = platform == "schip" ? Platform::SuperChip : platform == "xochip" ? Platform::XoChip : Platform::Chip8;
+		info.instructionsPerSecond = std::max(1, info.instructionsPerSecond);
+		roms.push_back(info);
+	}
+
+	std::sort(roms.begin(), roms.end(), [](const RomInfo& a, const RomInfo& b) { return a.file < b.file; });
+	return true;
+}
+
+bool RomIndex::Save() const
+{
+	std::ofstream index(std::filesystem::path(directory) / fileName);
+	index << "# Chip8Emu ROM index, rebuilt by Chip8Headless --scan. Speeds and platforms can be edited, they're kept until the ROM changes.\n";
+	index << "# hash size modified platform quirks instructionsPerSecond cycleUntilDraw file\n";
+	for (const RomInfo& info : roms)
+	{
+		index << std::hex << std::setw(16) << std::setfill('0') << info.hash << std::dec << std::setfill(' ')
+			<< " " << info.size << " " << info.modified << " " << PlatformName(info.platform)
+			<< " " << std::hex << info.quirks << std::dec << " " << info.instructionsPerSecond
+			<< " " << (info.cycleUntilDraw ? 1 : 0) << " " << info.file << "\n";
+	}
+	if (!index)
+	{
+		return false;
+	}
+	changed = false;
+	return true;
+}
+
+int RomIndex::Scan(const std::string& scanDirectory)
+{
+	if (!indexed || scanDirectory != directory)
+	{
+		Load(scanDirectory);
+	}
+
+	std::vector<std::string> files;
+	std::error_code error;
+	for (const std::filesystem::directory_entry& entry : std::filesystem::directory_iterator(directory, error))
+	{
+		std::string file = entry.path().filename().string();
+		if (entry.is_regular_file(error) && IsRomFile(file))
+		{
+			files.push_back(file);
+		}
+	}
+	std::sort(files.begin(), files.end());
+
+	// Entries whose file is gone
+	size_t before = roms.size();
+	roms.erase(std::remove_if(roms.begin(), roms.end(),
+		[&files](const RomInfo& info) { return !std::binary_search(files.begin(), files.end(), info.file); }), roms.end());
+	changed |= roms.size() != before;
+
+	int analyzed = 0;
+	for (const std::string& file : files)
+	{
+		RomInfo* info;
+		if (RefreshEntry(file, info) && info)
+		{
+			analyzed++;
+		}
+	}
+	return analyzed;
+}
+
+const RomInfo* RomIndex::Refresh(const std::string& refreshDirectory, const std::string& file)
+{
+	if (!indexed || refreshDirectory != directory)
+	{
+		Load(refreshDirectory);
+	}
+
+	RomInfo* info;
+	RefreshEntry(file, info);
+	return info;
+}
+
+// Points info at the file's up to date entry (nullptr if the file can't be read), returns whether it had to be analyzed
+bool RomIndex::RefreshEntry(const std::string& file, RomInfo*& info)
+{
+	std::filesystem::path path = std::filesystem::path(directory) / file;
+	std::error_code error;
+	uint64_t size = std::filesystem::file_size(path, error);
+	long long modified = error ? 0 : static_cast<long long>(std::filesystem::last_write_time(path, error).time_since_epoch().count());
+	info = Entry(file);
+	if (error)
+	{
+		info = nullptr;
+		return false;
+	}
+	if (info && info->size == size && info->modified == modified)
+	{
+		return false;
+	}
+
+	MappedFile rom;
+	if (!rom.Open(path.string().c_str()))
+	{
+		info = nullptr;
+		return false;
+	}
+
+	RomInfo analyzed = Analyze(file, rom.Data(), rom.Size());
+	analyzed.modified = modified;
+	if (info)
+	{
+		*info = analyzed;
+	}
+	else
+	{
+		auto position = std::lower_bound(roms.begin(), roms.end(), file, [](const RomInfo& a, const std::string& name) { return a.file < name; });
+		info = &*roms.insert(position, analyzed);
+	}
+	changed = true;
+	return true;
+}
+
+RomInfo* RomIndex::Entry(const std::string& file)
+{
+	auto position = std::lower_bound(roms.begin(), roms.end(), file, [](const RomInfo& a, const std::string& name) { return a.file < name; });
+	return position != roms.end() && position->file == file ? &*position : nullptr;
+}
+
+const RomInfo* RomIndex::Find(uint64_t hash) const
+{
+	for (const RomInfo& info : roms)
+	{
+		if (info.hash == hash)
+		{
+			return &info;
+		}
+	}
+	return nullptr;
+}
+
+const std::vector<RomInfo>& RomIndex::Roms() const
+{
+	return roms;
+}
+
+bool RomIndex::Changed() const
+{
+	return changed;
+}
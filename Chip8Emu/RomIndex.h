@@ -0,0 +1,77 @@
+#pragma once
+#include "Chip8Emu.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Machine a ROM was written for, guessed from the instructions it contains and its file extension
+enum class Platform
+{
+	Chip8,
+	SuperChip,
+	XoChip
+};
+
+// Behaviours that differ between interpreters. A ROM's quirks are the ones its platform prescribes
+// for instructions it actually uses, so a ROM without FX55/FX65 never reports the load/store quirk.
+enum RomQuirk : uint32_t
+{
+	QuirkVFReset = 1 << 0, // 8XY1/8XY2/8XY3 clear VF
+	QuirkShiftVY = 1 << 1, // 8XY6/8XYE shift VY into VX instead of shifting VX
+	QuirkLoadStoreIncrement = 1 << 2, // FX55/FX65 leave I past the last register
+	QuirkJumpVX = 1 << 3, // BNNN jumps to XNN + VX instead of NNN + V0
+	QuirkWrap = 1 << 4 // DXYN wraps sprites around the screen edges instead of clipping them
+};
+
+// What the index knows about one ROM file, and the core configuration chosen for it
+struct RomInfo
+{
+	std::string file; // Relative to the indexed directory
+	uint64_t hash = 0; // Chip8Emu::HashBytes of the file, the same as GetRomHash once loaded
+	uint64_t size = 0;
+	long long modified = 0; // File timestamp when analyzed, a different one means the file has to be analyzed again
+	Platform platform = Platform::Chip8;
+	uint32_t quirks = 0; // RomQuirk bits
+	int instructionsPerSecond = 600;
+	bool cycleUntilDraw = true;
+
+	void Apply(Chip8Emu& emu) const; // Configures emu for this ROM
+	uint32_t UnsupportedQuirks() const; // Quirks the ROM needs that Chip8Emu doesn't emulate
+};
+
+// Per-directory cache of RomInfo, kept in a text file in that directory (one ROM per line, editable by hand
+// to override a speed or platform guess). Refreshing it only stats files; a ROM is read and analyzed again
+// only when it's new or its size or timestamp changed. Only Save writes the file, the emulators just read it.
+class RomIndex
+{
+public:
+	static const char* const fileName; // Name of the cache file inside the indexed directory
+
+	bool Load(const std::string& directory); // Reads the directory's cache, false if there is none or it's unreadable
+	bool Save() const;
+
+	// Brings every ROM file in the directory up to date and drops entries whose file is gone.
+	// Returns how many files had to be analyzed.
+	int Scan(const std::string& directory);
+
+	// Brings one file's entry up to date, analyzing it if needed. nullptr if the file can't be read.
+	const RomInfo* Refresh(const std::string& directory, const std::string& file);
+
+	const RomInfo* Find(uint64_t hash) const;
+	const std::vector<RomInfo>& Roms() const;
+	bool Changed() const; // Entries were added, updated or removed since the last Load or Save
+
+	static RomInfo Analyze(const std::string& file, const unsigned char* data, size_t size);
+	static const char* PlatformName(Platform platform);
+
+private:
+	RomInfo* Entry(const std::string& file);
+	bool RefreshEntry(const std::string& file, RomInfo*& info);
+
+	std::string directory;
+	bool indexed = false; // directory holds the index that was loaded
+	std::vector<RomInfo> roms; // Sorted by file name
+	mutable bool changed = false;
+};
@@ -0,0 +1,160 @@
+#include "RomPack.h"
+#include "Chip8Emu.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+static const uint32_t packVersion = 1;
+static const size_t headerSize = 12;
+static const size_t entrySize = 16;
+
+static uint64_t ReadInteger(const unsigned char* bytes, int size)
+{
+	uint64_t value = 0;
+	for (int i = 0; i < size; i++)
+	{
+		value |= static_cast<uint64_t>(bytes[i]) << (i * 8);
+	}
+	return value;
+}
+
+static void WriteInteger(std::ostream& out, uint64_t value, int size)
+{
+	for (int i = 0; i < size; i++)
+	{
+		out.put(static_cast<char>(value >> (i * 8)));
+	}
+}
+
+bool RomPack::Open(const char* filename)
+{
+	Close();
+	if (!file.Open(filename))
+	{
+		return false;
+	}
+
+	const unsigned char* data = file.Data();
+	size_t size = file.Size();
+	if (size < headerSize || std::memcmp(data, "C8PK", 4) != 0 || ReadInteger(data + 4, 4) != packVersion)
+	{
+		file.Close();
+		return false;
+	}
+
+	// Every entry has to point inside the file and the hashes have to be strictly ascending for Find
+	size_t entries = static_cast<size_t>(ReadInteger(data + 8, 4));
+	bool valid = entries <= (size - headerSize) / entrySize;
+	for (size_t i = 0; valid && i < entries; i++)
+	{
+		const unsigned char* entry = data + headerSize + i * entrySize;
+		uint64_t offset = ReadInteger(entry + 8, 4);
+		uint64_t romSize = ReadInteger(entry + 12, 4);
+		valid = romSize <= Chip8Emu::MaxRomSize && offset <= size && romSize <= size - offset
+			&& (i == 0 || ReadInteger(entry - entrySize, 8) < ReadInteger(entry, 8));
+	}
+	if (!valid)
+	{
+		file.Close();
+		return false;
+	}
+
+	count = entries;
+	return true;
+}
+
+void RomPack::Close()
+{
+	file.Close();
+	count = 0;
+}
+
+size_t RomPack::Count() const
+{
+	return count;
+}
+
+RomPack::Rom RomPack::Get(size_t index) const
+{
+	const unsigned char* entry = file.Data() + headerSize + index * entrySize;
+	Rom rom;
+	rom.hash = ReadInteger(entry, 8);
+	rom.data = file.Data() + ReadInteger(entry + 8, 4);
+	rom.size = static_cast<size_t>(ReadInteger(entry + 12, 4));
+	return rom;
+}
+
+// Binary search of the index, straight out of the mapping
+bool RomPack::Find(uint64_t hash, Rom& rom) const
+{
+	size_t low = 0;
+	size_t high = count;
+	while (low < high)
+	{
+		size_t middle = low + (high - low) / 2;
+		uint64_t middleHash = ReadInteger(file.Data() + headerSize + middle * entrySize, 8);
+		if (middleHash < hash)
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+	if (low == count || ReadInteger(file.Data() + headerSize + low * entrySize, 8) != hash)
+	{
+		return false;
+	}
+	rom = Get(low);
+	return true;
+}
+
+bool RomPack::Write(const char* filename, const std::vector<std::string>& romFiles, std::string& error)
+{
+	struct PackedRom
+	{
+		uint64_t hash;
+		std::vector<unsigned char> image;
+	};
+	std::vector<PackedRom> roms;
+	for (const std::string& romFile : romFiles)
+	{
+		MappedFile rom;
+		if (!rom.Open(romFile.c_str()) || rom.Size() > Chip8Emu::MaxRomSize)
+		{
+			error = romFile;
+			return false;
+		}
+		roms.push_back({ Chip8Emu::HashBytes(rom.Data(), rom.Size()), std::vector<unsigned char>(rom.Data(), rom.Data() + rom.Size()) });
+	}
+
+	std::sort(roms.begin(), roms.end(), [](const PackedRom& a, const PackedRom& b) { return a.hash < b.hash; });
+	roms.erase(std::unique(roms.begin(), roms.end(), [](const PackedRom& a, const PackedRom& b) { return a.hash == b.hash; }), roms.end());
+
+	std::ofstream out(filename, std::ios::binary);
+	out.write("C8PK", 4);
+	WriteInteger(out, packVersion, 4);
+	WriteInteger(out, roms.size(), 4);
+
+	size_t offset = headerSize + roms.size() * entrySize;
+	for (const PackedRom& rom : roms)
+	{
+		WriteInteger(out, rom.hash, 8);
+		WriteInteger(out, offset, 4);
+		WriteInteger(out, rom.image.size(), 4);
+		offset += rom.image.size();
+	}
+	for (const PackedRom& rom : roms)
+	{
+		out.write(reinterpret_cast<const char*>(rom.image.data()), static_cast<std::streamsize>(rom.image.size()));
+	}
+
+	if (!out)
+	{
+		error = filename;
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include "MappedFile.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Many ROMs in one file, looked up by hash (Chip8Emu::HashBytes of the ROM, the same as GetRomHash).
+// The whole pack is mapped once and ROMs are handed out as pointers into the mapping, so a batch run over
+// thousands of ROMs does one open instead of thousands and copies each ROM only into emulator memory.
+//
+// File layout, integers little-endian:
+//   "C8PK", version (4), ROM count (4), then per ROM sorted by hash: hash (8), offset (4), size (4),
+//   then the ROM images at their offsets from the start of the file.
+class RomPack
+{
+public:
+	struct Rom
+	{
+		uint64_t hash;
+		const unsigned char* data; // Points into the mapped pack, valid while it stays open
+		size_t size;
+	};
+
+	bool Open(const char* filename); // Validates the header and index, false if either is broken
+	void Close();
+
+	size_t Count() const;
+	Rom Get(size_t index) const; // In hash order
+	bool Find(uint64_t hash, Rom& rom) const;
+
+	// Packs the given ROM files, duplicates stored once. On failure error names the file that couldn't be used.
+	static bool Write(const char* filename, const std::vector<std::string>& romFiles, std::string& error);
+
+private:
+	MappedFile file;
+	size_t count = 0;
+};
@@ -0,0 +1,47 @@
+#pragma once
+#include <atomic>
+
+// Lock-free triple buffer for one producer thread and one consumer thread.
+// The producer fills WriteBuffer() and calls Publish(); the consumer calls Consume() and, when it returns true,
+// reads the newest published value from ReadBuffer(). Neither side ever waits for the other, and values the
+// consumer was too slow to take are simply replaced by newer ones.
+template <typename T>
+class TripleBuffer
+{
+public:
+	T& WriteBuffer()
+	{
+		return buffers[writeIndex];
+	}
+
+	void Publish()
+	{
+		unsigned int previous = middle.exchange(writeIndex | freshBit, std::memory_order_acq_rel);
+		writeIndex = previous & indexMask;
+	}
+
+	bool Consume()
+	{
+		if ((middle.load(std::memory_order_relaxed) & freshBit) == 0)
+		{
+			return false;
+		}
+		unsigned int previous = middle.exchange(readIndex, std::memory_order_acq_rel);
+		readIndex = previous & indexMask;
+		return true;
+	}
+
+	const T& ReadBuffer() const
+	{
+		return buffers[readIndex];
+	}
+
+private:
+	static const unsigned int indexMask = 0x3;
+	static const unsigned int freshBit = 0x4; // Set while the middle buffer holds a value the consumer hasn't taken
+
+	T buffers[3] = {};
+	std::atomic<unsigned int> middle{ 1 }; // Buffer index exchanged between the two sides, plus freshBit
+	unsigned int writeIndex = 0; // Owned by the producer
+	unsigned int readIndex = 2; // Owned by the consumer
+};
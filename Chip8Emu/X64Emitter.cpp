@@ -0,0 +1,288 @@
+#include "X64Emitter.h"
+
+X64Emitter::X64Emitter(unsigned char* buffer, size_t capacity) :
+	buffer(buffer),
+	capacity(capacity)
+{
+}
+
+size_t X64Emitter::Size() const
+{
+	return size;
+}
+
+bool X64Emitter::Overflowed() const
+{
+	return overflowed;
+}
+
+void X64Emitter::Byte(unsigned int value)
+{
+	if (size < capacity)
+	{
+		buffer[size++] = static_cast<unsigned char>(value);
+	}
+	else
+	{
+		overflowed = true;
+	}
+}
+
+void X64Emitter::Bytes(uint64_t value, int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		Byte(static_cast<unsigned int>(value >> (i * 8) & 0xFF));
+	}
+}
+
+// REX carries the operand size and the high bit of each register number. A byte access to SPL, BPL, SIL
+// or DIL needs an otherwise empty REX too, without one those encodings mean AH, CH, DH and BH.
+void X64Emitter::Rex(bool wide, int reg, int index, int base, bool force)
+{
+	unsigned int rex = 0x40 | (wide ? 8 : 0) | (reg & 8) >> 1 | (index & 8) >> 2 | (base & 8) >> 3;
+	if (rex != 0x40 || force)
+	{
+		Byte(rex);
+	}
+}
+
+void X64Emitter::ModRmRegister(int reg, int rm)
+{
+	Byte(0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+void X64Emitter::ModRmMemory(int reg, const Mem& mem)
+{
+	int base = mem.base & 7;
+
+	// RBP and R13 have no displacement-free form, mod 00 with them means RIP-relative (or no base with a SIB)
+	int mod = 2;
+	if (mem.displacement == 0 && base != 5)
+	{
+		mod = 0;
+	}
+	else if (mem.displacement >= -128 && mem.displacement <= 127)
+	{
+		mod = 1;
+	}
+
+	// RSP and R12 as a base can only be encoded through a SIB byte
+	if (mem.index != NoReg || base == 4)
+	{
+		int scale = mem.scale == 8 ? 3 : mem.scale == 4 ? 2 : mem.scale == 2 ? 1 : 0;
+		int index = mem.index != NoReg ? mem.index & 7 : 4; // 100 is "no index"
+		Byte(mod << 6 | (reg & 7) << 3 | 4);
+		Byte(scale << 6 | index << 3 | base);
+	}
+	else
+	{
+		Byte(mod << 6 | (reg & 7) << 3 | base);
+	}
+
+	if (mod == 1)
+	{
+		Bytes(static_cast<uint32_t>(mem.displacement), 1);
+	}
+	else if (mod == 2)
+	{
+		Bytes(static_cast<uint32_t>(mem.displacement), 4);
+	}
+}
+
+void X64Emitter::Push(Reg reg)
+{
+	Rex(false, 0, 0, reg);
+	Byte(0x50 | (reg & 7));
+}
+
+void X64Emitter::Pop(Reg reg)
+{
+	Rex(false, 0, 0, reg);
+	Byte(0x58 | (reg & 7));
+}
+
+void X64Emitter::Ret()
+{
+	Byte(0xC3);
+}
+
+void X64Emitter::CallIndirect(Reg target)
+{
+	Rex(false, 0, 0, target);
+	Byte(0xFF);
+	ModRmRegister(2, target);
+}
+
+void X64Emitter::Mov(Reg dst, Reg src)
+{
+	Rex(false, src, 0, dst);
+	Byte(0x89);
+	ModRmRegister(src, dst);
+}
+
+void X64Emitter::Mov64(Reg dst, Reg src)
+{
+	Rex(true, src, 0, dst);
+	Byte(0x89);
+	ModRmRegister(src, dst);
+}
+
+void X64Emitter::MovImm(Reg dst, uint32_t value)
+{
+	Rex(false, 0, 0, dst);
+	Byte(0xB8 | (dst & 7));
+	Bytes(value, 4);
+}
+
+void X64Emitter::MovImm64(Reg dst, uint64_t value)
+{
+	Rex(true, 0, 0, dst);
+	Byte(0xB8 | (dst & 7));
+	Bytes(value, 8);
+}
+
+void X64Emitter::AluImm64(AluOp op, Reg dst, int32_t value)
+{
+	Rex(true, 0, 0, dst);
+	if (value >= -128 && value <= 127)
+	{
+		Byte(0x83);
+		ModRmRegister(op, dst);
+		Bytes(static_cast<uint32_t>(value), 1);
+	}
+	else
+	{
+		Byte(0x81);
+		ModRmRegister(op, dst);
+		Bytes(static_cast<uint32_t>(value), 4);
+	}
+}
+
+void X64Emitter::LoadByte(Reg dst, const Mem& src)
+{
+	Rex(false, dst, src.index != NoReg ? src.index : 0, src.base);
+	Byte(0x0F);
+	Byte(0xB6);
+	ModRmMemory(dst, src);
+}
+
+void X64Emitter::LoadWord(Reg dst, const Mem& src)
+{
+	Rex(false, dst, src.index != NoReg ? src.index : 0, src.base);
+	Byte(0x0F);
+	Byte(0xB7);
+	ModRmMemory(dst, src);
+}
+
+void X64Emitter::StoreByte(const Mem& dst, Reg src)
+{
+	Rex(false, src, dst.index != NoReg ? dst.index : 0, dst.base, src >= RSP && src <= RDI);
+	Byte(0x88);
+	ModRmMemory(src, dst);
+}
+
+void X64Emitter::StoreWord(const Mem& dst, Reg src)
+{
+	Byte(0x66);
+	Rex(false, src, dst.index != NoReg ? dst.index : 0, dst.base);
+	Byte(0x89);
+	ModRmMemory(src, dst);
+}
+
+void X64Emitter::StoreByteImm(const Mem& dst, uint8_t value)
+{
+	Rex(false, 0, dst.index != NoReg ? dst.index : 0, dst.base);
+	Byte(0xC6);
+	ModRmMemory(0, dst);
+	Byte(value);
+}
+
+void X64Emitter::StoreWordImm(const Mem& dst, uint16_t value)
+{
+	Byte(0x66);
+	Rex(false, 0, dst.index != NoReg ? dst.index : 0, dst.base);
+	Byte(0xC7);
+	ModRmMemory(0, dst);
+	Bytes(value, 2);
+}
+
+void X64Emitter::Alu(AluOp op, Reg dst, Reg src)
+{
+	Rex(false, src, 0, dst);
+	Byte(op << 3 | 0x01); // The "r/m32, r32" form of each operation
+	ModRmRegister(src, dst);
+}
+
+void X64Emitter::AluImm(AluOp op, Reg dst, int32_t value)
+{
+	Rex(false, 0, 0, dst);
+	if (value >= -128 && value <= 127)
+	{
+		Byte(0x83);
+		ModRmRegister(op, dst);
+		Bytes(static_cast<uint32_t>(value), 1);
+	}
+	else
+	{
+		Byte(0x81);
+		ModRmRegister(op, dst);
+		Bytes(static_cast<uint32_t>(value), 4);
+	}
+}
+
+void X64Emitter::ShlImm(Reg reg, uint8_t count)
+{
+	Rex(false, 0, 0, reg);
+	Byte(0xC1);
+	ModRmRegister(4, reg);
+	Byte(count);
+}
+
+void X64Emitter::ShrImm(Reg reg, uint8_t count)
+{
+	Rex(false, 0, 0, reg);
+	Byte(0xC1);
+	ModRmRegister(5, reg);
+	Byte(count);
+}
+
+void X64Emitter::ShrCl(Reg reg)
+{
+	Rex(false, 0, 0, reg);
+	Byte(0xD3);
+	ModRmRegister(5, reg);
+}
+
+void X64Emitter::ImulImm(Reg dst, Reg src, int32_t value)
+{
+	Rex(false, dst, 0, src);
+	if (value >= -128 && value <= 127)
+	{
+		Byte(0x6B);
+		ModRmRegister(dst, src);
+		Bytes(static_cast<uint32_t>(value), 1);
+	}
+	else
+	{
+		Byte(0x69);
+		ModRmRegister(dst, src);
+		Bytes(static_cast<uint32_t>(value), 4);
+	}
+}
+
+void X64Emitter::Setcc(Condition condition, Reg dst)
+{
+	Rex(false, 0, 0, dst, dst >= RSP && dst <= RDI);
+	Byte(0x0F);
+	Byte(0x90 | condition);
+	ModRmRegister(0, dst);
+}
+
+void X64Emitter::Cmovcc(Condition condition, Reg dst, Reg src)
+{
+	Rex(false, dst, 0, src);
+	Byte(0x0F);
+	Byte(0x40 | condition);
+	ModRmRegister(dst, src);
+}
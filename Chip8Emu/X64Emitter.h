@@ -0,0 +1,66 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// Writes x86-64 machine code into a caller-supplied buffer. Only the handful of instruction forms the
+// Chip8Emu block translator uses are covered; each method appends one instruction. Register operands
+// are 32-bit unless the name says otherwise, byte and word stores take the low part of the register.
+class X64Emitter
+{
+public:
+	enum Reg { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15, NoReg };
+	enum Condition { Below = 0x2, AboveOrEqual = 0x3, Equal = 0x4, NotEqual = 0x5, BelowOrEqual = 0x6, Above = 0x7 };
+	enum AluOp { Add = 0, Or = 1, And = 4, Sub = 5, Xor = 6, Cmp = 7 }; // The /digit of the 0x81 group
+
+	// Memory operand [base + index * scale + displacement]
+	struct Mem
+	{
+		Reg base;
+		int32_t displacement;
+		Reg index = NoReg;
+		int scale = 1; // 1, 2, 4 or 8
+	};
+
+	X64Emitter(unsigned char* buffer, size_t capacity);
+
+	size_t Size() const; // Bytes written so far
+	bool Overflowed() const; // An instruction didn't fit, the buffer holds no usable code
+
+	void Push(Reg reg);
+	void Pop(Reg reg);
+	void Ret();
+	void CallIndirect(Reg target);
+	void Mov(Reg dst, Reg src); // Zero-extends into the whole 64-bit register
+	void Mov64(Reg dst, Reg src);
+	void MovImm(Reg dst, uint32_t value); // Zero-extends into the whole 64-bit register
+	void MovImm64(Reg dst, uint64_t value);
+	void AluImm64(AluOp op, Reg dst, int32_t value); // For adjusting rsp
+
+	void LoadByte(Reg dst, const Mem& src); // movzx
+	void LoadWord(Reg dst, const Mem& src); // movzx
+	void StoreByte(const Mem& dst, Reg src);
+	void StoreWord(const Mem& dst, Reg src);
+	void StoreByteImm(const Mem& dst, uint8_t value);
+	void StoreWordImm(const Mem& dst, uint16_t value);
+
+	void Alu(AluOp op, Reg dst, Reg src);
+	void AluImm(AluOp op, Reg dst, int32_t value);
+	void ShlImm(Reg reg, uint8_t count);
+	void ShrImm(Reg reg, uint8_t count);
+	void ShrCl(Reg reg);
+	void ImulImm(Reg dst, Reg src, int32_t value);
+	void Setcc(Condition condition, Reg dst); // Writes the low byte only
+	void Cmovcc(Condition condition, Reg dst, Reg src);
+
+private:
+	void Byte(unsigned int value);
+	void Bytes(uint64_t value, int count); // Little-endian
+	void Rex(bool wide, int reg, int index, int base, bool force = false); // Only emitted when needed
+	void ModRmRegister(int reg, int rm);
+	void ModRmMemory(int reg, const Mem& mem);
+
+	unsigned char* buffer;
+	size_t capacity;
+	size_t size = 0;
+	bool overflowed = false;
+};
@@ -0,0 +1,465 @@
+#include "Chip8Emu.h"
+#include "Movie.h"
+#include "RomIndex.h"
+#include "RomPack.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Runs a ROM without a window: no olc, no GL context, just the interpreter at full host speed.
+//
+// Usage: Chip8Headless rom [--cycles N | --frames N] [--seed N] [--ips N] [--dispatch switch|table|cached|jit]
+//                          [--input script | --replay movie] [--record movie] [--frame-hashes]
+//                          [--load-state file] [--save-state file] [--screen] [--profile] [--rom-hash H]
+//        Chip8Headless --make-pack pack rom...
+//        Chip8Headless --scan directory
+//
+// Without --ips the speed comes from the ROM index (chip8index.txt) in the ROM's directory, or from analyzing
+// the ROM when the index has no current entry for it. Only --scan writes the index: it brings a whole
+// directory's index up to date, saves it and lists it.
+// rom can also be a ROM pack, the ROM in it is picked by --rom-hash or, when replaying, by the movie's ROM hash.
+// --make-pack writes the given ROMs into one pack, indexed by the hash GetRomHash reports, and lists those hashes.
+// An input script has one key change per line, "cycle key state", e.g. "1200 5 1" presses key 5 once
+// 1200 instructions have run and "1500 5 0" releases it. Keys are hex digits, lines starting with # are ignored.
+// --replay plays a movie recorded by the emulator (Chip8Emu --record) or by --record here. The movie's seed and
+// speed are used and the run lasts as long as the recording unless --cycles/--frames say otherwise. At the end
+// the display is checked against the recording; a mismatch exits with status 3.
+// --record writes the run (its input, ROM hash, seed and final display) as a movie.
+// --frame-hashes prints the display hash after every 60 Hz frame, for diffing two runs frame by frame.
+// --load-state starts from a state written by --save-state (or Chip8Emu::WriteState) instead of power-on. Movies
+// start at power-on, so it can't be combined with --record or --replay.
+// --cycles/--frames then count from the loaded state, input script cycles stay absolute.
+// --profile prints the hot-address table and opcode mix, which needs a build with CHIP8_PROFILE defined.
+
+struct ScriptEvent
+{
+	unsigned long long cycle;
+	int key;
+	bool down;
+};
+
+// Reads an input script as keypad states, one per line in cycle order
+static bool LoadInputScript(const char* filename, std::vector<KeyEvent>& keyEvents)
+{
+	std::vector<ScriptEvent> events;
+	std::ifstream script(filename);
+	if (!script)
+	{
+		return false;
+	}
+
+	std::string line;
+	int lineNumber = 0;
+	while (std::getline(script, line))
+	{
+		lineNumber++;
+		if (line.empty() || line[0] == '#')
+		{
+			continue;
+		}
+
+		std::istringstream fields(line);
+		ScriptEvent event;
+		int state;
+		if (!(fields >> event.cycle >> std::hex >> event.key >> std::dec >> state) || event.key < 0 || event.key > 0xF)
+		{
+			std::cerr << filename << ":" << lineNumber << ": expected \"cycle key state\"" << std::endl;
+			return false;
+		}
+		event.down = state != 0;
+		events.push_back(event);
+	}
+
+	std::stable_sort(events.begin(), events.end(), [](const ScriptEvent& a, const ScriptEvent& b) { return a.cycle < b.cycle; });
+
+	unsigned short keys = 0;
+	for (const ScriptEvent& event : events)
+	{
+		keys = static_cast<unsigned short>(event.down ? keys | 1 << event.key : keys & ~(1 << event.key));
+		keyEvents.push_back({ event.cycle, keys });
+	}
+	return true;
+}
+
+static bool ParseDispatch(const char* name, Dispatch& dispatch)
+{
+	const char* names[] = { "switch", "table", "cached", "jit" };
+	const Dispatch values[] = { Dispatch::Switch, Dispatch::Table, Dispatch::Cached, Dispatch::Jit };
+	for (int i = 0; i < 4; i++)
+	{
+		if (std::strcmp(name, names[i]) == 0)
+		{
+			dispatch = values[i];
+			return true;
+		}
+	}
+	return false;
+}
+
+static void PrintScreen(const Chip8Emu& emu)
+{
+	for (int y = 0; y < 32; y++)
+	{
+		std::string row(64, '.');
+		for (int x = 0; x < 64; x++)
+		{
+			if (emu.GetPixel(x, y))
+			{
+				row[x] = '#';
+			}
+		}
+		std::cout << row << "\n";
+	}
+}
+
+static int Usage()
+{
+	std::cerr << "Usage: Chip8Headless rom [--cycles N | --frames N] [--seed N] [--ips N]"
+		" [--dispatch switch|table|cached|jit] [--input script | --replay movie] [--record movie] [--frame-hashes]"
+		" [--load-state file] [--save-state file] [--screen] [--profile] [--rom-hash H]\n"
+		"       Chip8Headless --make-pack pack rom...\n"
+		"       Chip8Headless --scan directory (writes the directory's chip8index.txt)" << std::endl;
+	return 2;
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2)
+	{
+		return Usage();
+	}
+
+	if (std::strcmp(argv[1], "--make-pack") == 0)
+	{
+		if (argc < 4)
+		{
+			return Usage();
+		}
+		std::vector<std::string> romFiles(argv + 3, argv + argc);
+		std::string error;
+		if (!RomPack::Write(argv[2], romFiles, error))
+		{
+			std::cerr << "Failed to pack " << error << std::endl;
+			return 1;
+		}
+		for (const std::string& romFile : romFiles)
+		{
+			MappedFile rom;
+			rom.Open(romFile.c_str());
+			std::cout << std::hex << std::setw(16) << std::setfill('0') << Chip8Emu::HashBytes(rom.Data(), rom.Size())
+				<< std::dec << std::setfill(' ') << " " << romFile << "\n";
+		}
+		RomPack pack;
+		pack.Open(argv[2]);
+		std::cout << "Packed " << pack.Count() << " ROMs into " << argv[2] << std::endl;
+		return 0;
+	}
+
+	if (std::strcmp(argv[1], "--scan") == 0)
+	{
+		if (argc != 3)
+		{
+			return Usage();
+		}
+		RomIndex index;
+		int analyzed = index.Scan(argv[2]);
+		if (index.Changed() && !index.Save())
+		{
+			std::cerr << "Failed to write the index in " << argv[2] << std::endl;
+			return 1;
+		}
+		for (const RomInfo& info : index.Roms())
+		{
+			std::cout << std::hex << std::setw(16) << std::setfill('0') << info.hash << std::dec << std::setfill(' ')
+				<< " " << std::setw(6) << std::left << RomIndex::PlatformName(info.platform) << std::right
+				<< std::setw(6) << info.instructionsPerSecond << " ips  quirks " << std::hex << info.quirks << std::dec
+				<< "  " << info.file << "\n";
+		}
+		std::cout << index.Roms().size() << " ROMs in " << argv[2] << ", " << analyzed << " analyzed" << std::endl;
+		return 0;
+	}
+
+	const char* romName = argv[1];
+	unsigned long long cycles = 0;
+	unsigned long long frames = 600;
+	bool lengthGiven = false;
+	uint64_t seed = 0;
+	int instructionsPerSecond = 600;
+	bool ipsGiven = false;
+	Dispatch dispatch = Dispatch::Cached;
+	const char* inputName = nullptr;
+	const char* replayName = nullptr;
+	const char* recordName = nullptr;
+	bool frameHashes = false;
+	const char* loadStateName = nullptr;
+	const char* saveStateName = nullptr;
+	bool showScreen = false;
+	bool showProfile = false;
+	uint64_t romHash = 0;
+
+	for (int i = 2; i < argc; i++)
+	{
+		bool hasValue = i + 1 < argc;
+		if (std::strcmp(argv[i], "--cycles") == 0 && hasValue)
+		{
+			cycles = std::strtoull(argv[++i], nullptr, 0);
+			frames = 0;
+			lengthGiven = true;
+		}
+		else if (std::strcmp(argv[i], "--frames") == 0 && hasValue)
+		{
+			frames = std::strtoull(argv[++i], nullptr, 0);
+			cycles = 0;
+			lengthGiven = true;
+		}
+		else if (std::strcmp(argv[i], "--seed") == 0 && hasValue)
+		{
+			seed = std::strtoull(argv[++i], nullptr, 0);
+		}
+		else if (std::strcmp(argv[i], "--ips") == 0 && hasValue)
+		{
+			instructionsPerSecond = std::max(1, std::atoi(argv[++i]));
+			ipsGiven = true;
+		}
+		else if (std::strcmp(argv[i], "--dispatch") == 0 && hasValue)
+		{
+			if (!ParseDispatch(argv[++i], dispatch))
+			{
+				return Usage();
+			}
+		}
+		else if (std::strcmp(argv[i], "--input") == 0 && hasValue)
+		{
+			inputName = argv[++i];
+		}
+		else if (std::strcmp(argv[i], "--replay") == 0 && hasValue)
+		{
+			replayName = argv[++i];
+		}
+		else if (std::strcmp(argv[i], "--record") == 0 && hasValue)
+		{
+			recordName = argv[++i];
+		}
+		else if (std::strcmp(argv[i], "--frame-hashes") == 0)
+		{
+			frameHashes = true;
+		}
+		else if (std::strcmp(argv[i], "--load-state") == 0 && hasValue)
+		{
+			loadStateName = argv[++i];
+		}
+		else if (std::strcmp(argv[i], "--save-state") == 0 && hasValue)
+		{
+			saveStateName = argv[++i];
+		}
+		else if (std::strcmp(argv[i], "--screen") == 0)
+		{
+			showScreen = true;
+		}
+		else if (std::strcmp(argv[i], "--profile") == 0)
+		{
+			showProfile = true;
+		}
+		else if (std::strcmp(argv[i], "--rom-hash") == 0 && hasValue)
+		{
+			romHash = std::strtoull(argv[++i], nullptr, 16);
+		}
+		else
+		{
+			return Usage();
+		}
+	}
+
+	if ((inputName && replayName) || ((recordName || replayName) && loadStateName))
+	{
+		return Usage(); // Movies always start at power-on
+	}
+
+	Movie movie;
+	std::vector<KeyEvent> events;
+	if (inputName && !LoadInputScript(inputName, events))
+	{
+		std::cerr << "Failed to read input script " << inputName << std::endl;
+		return 1;
+	}
+	if (replayName)
+	{
+		if (!movie.Load(replayName))
+		{
+			std::cerr << "Failed to read movie " << replayName << std::endl;
+			return 1;
+		}
+		events = movie.events;
+		seed = movie.seed;
+		instructionsPerSecond = movie.instructionsPerSecond;
+		if (!lengthGiven)
+		{
+			cycles = movie.length;
+			frames = 0;
+		}
+	}
+
+	RomPack pack;
+	bool fromPack = pack.Open(romName);
+	if (!fromPack && !ipsGiven && !replayName)
+	{
+		std::filesystem::path path(romName);
+		RomIndex index;
+		const RomInfo* info = index.Refresh(path.has_parent_path() ? path.parent_path().string() : ".", path.filename().string());
+		if (info)
+		{
+			instructionsPerSecond = info->instructionsPerSecond;
+			std::cout << "Platform: " << RomIndex::PlatformName(info->platform) << ", " << instructionsPerSecond << " instructions/sec" << std::endl;
+		}
+	}
+
+	// A frame is one 60 Hz timer period of emulated time
+	if (frames > 0)
+	{
+		cycles = frames * instructionsPerSecond / 60;
+	}
+
+	Chip8Emu emu;
+	emu.Start();
+	emu.dispatch = dispatch;
+	emu.SetInstructionsPerSecond(instructionsPerSecond);
+	emu.Seed(seed);
+	if (fromPack)
+	{
+		RomPack::Rom rom;
+		if (!pack.Find(replayName && romHash == 0 ? movie.romHash : romHash, rom) || !emu.LoadRom(rom.data, rom.size))
+		{
+			std::cerr << "No ROM with that hash in " << romName << " (pick one with --rom-hash)" << std::endl;
+			return 1;
+		}
+	}
+	else if (!emu.LoadRom(romName))
+	{
+		std::cerr << "Failed to open " << romName << " (missing, or over " << Chip8Emu::MaxRomSize << " bytes)" << std::endl;
+		return 1;
+	}
+	if (replayName && emu.GetRomHash() != movie.romHash)
+	{
+		std::cerr << romName << " is not the ROM " << replayName << " was recorded on" << std::endl;
+		return 1;
+	}
+	if (loadStateName)
+	{
+		std::ifstream stateFile(loadStateName, std::ios::binary);
+		if (!emu.ReadState(stateFile))
+		{
+			std::cerr << "Failed to read state " << loadStateName << std::endl;
+			return 1;
+		}
+		cycles += emu.GetCycleCount();
+	}
+
+	// Run in chunks (a frame at a time when printing frame hashes). Before each one the key changes it will
+	// reach are queued on the core, which applies them at their exact cycles; the chunk ends before the first
+	// change that didn't fit in the queue.
+	movie.events.clear();
+	unsigned long long startCycle = emu.GetCycleCount();
+	unsigned long long frameNumber = 0;
+	size_t nextEvent = 0;
+	auto start = std::chrono::steady_clock::now();
+	while (emu.GetCycleCount() < cycles)
+	{
+		unsigned long long until = cycles;
+		unsigned long long frameEnd = emu.GetCycleCount() + emu.CyclesUntilTimerTick();
+		if (frameHashes)
+		{
+			until = std::min(until, frameEnd);
+		}
+
+		// Changes from before a loaded state are all due now. A full queue is flushed by running up to its next
+		// event, which is never past the one being queued, so the chunk's end still holds.
+		for (int queued = 0; nextEvent < events.size() && events[nextEvent].cycle < until
+			&& (queued < 8 || events[nextEvent].cycle <= emu.GetCycleCount()); nextEvent++, queued++)
+		{
+			unsigned long long applied;
+			while (!emu.QueueKeys(events[nextEvent].cycle, events[nextEvent].keys, applied))
+			{
+				emu.RunUntil(RunEvent::NoEvent, emu.CyclesUntilKeyEvent());
+			}
+			movie.Record(applied, events[nextEvent].keys);
+		}
+		if (nextEvent < events.size())
+		{
+			until = std::min(until, std::max(events[nextEvent].cycle, emu.GetCycleCount() + 1));
+		}
+		unsigned long long chunk = std::min<unsigned long long>(until - emu.GetCycleCount(), 1u << 30);
+		emu.RunCycles(static_cast<int>(chunk));
+
+		if (frameHashes && emu.GetCycleCount() == frameEnd)
+		{
+			std::cout << "frame " << ++frameNumber << " cycle " << frameEnd << " hash 0x" << std::hex << std::setw(16)
+				<< std::setfill('0') << emu.FrameHash() << std::dec << std::setfill(' ') << "\n";
+		}
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	if (recordName)
+	{
+		movie.romHash = emu.GetRomHash();
+		movie.seed = seed;
+		movie.instructionsPerSecond = instructionsPerSecond;
+		movie.length = emu.GetCycleCount();
+		movie.finalFrameHash = emu.FrameHash();
+		movie.Truncate(movie.length);
+		if (!movie.Save(recordName))
+		{
+			std::cerr << "Failed to write movie " << recordName << std::endl;
+			return 1;
+		}
+	}
+
+	if (saveStateName)
+	{
+		std::ofstream stateFile(saveStateName, std::ios::binary);
+		emu.WriteState(stateFile);
+		if (!stateFile)
+		{
+			std::cerr << "Failed to write state " << saveStateName << std::endl;
+			return 1;
+		}
+	}
+
+	std::cout << "ROM: " << romName << "\n";
+	emu.PrintState(std::cout);
+	std::cout << "Frame hash: 0x" << std::hex << std::setw(16) << std::setfill('0') << emu.FrameHash() << std::dec << std::setfill(' ') << "\n";
+	if (showScreen)
+	{
+		PrintScreen(emu);
+	}
+	if (showProfile)
+	{
+		emu.PrintProfile(std::cout);
+	}
+
+	double seconds = std::max(elapsed.count(), 1e-9);
+	unsigned long long ran = emu.GetCycleCount() - startCycle;
+	double emulatedSeconds = static_cast<double>(ran) / instructionsPerSecond;
+	std::cout << "Time: " << seconds << " s, " << ran / seconds / 1e6 << " M instructions/sec, "
+		<< emulatedSeconds * 60.0 / seconds << " frames/sec (" << emulatedSeconds / seconds << "x realtime)" << std::endl;
+
+	if (replayName && emu.GetCycleCount() == movie.length)
+	{
+		if (emu.FrameHash() != movie.finalFrameHash)
+		{
+			std::cout << "Replay differs from the recording (expected frame hash 0x" << std::hex << movie.finalFrameHash << std::dec << ")" << std::endl;
+			return 3;
+		}
+		std::cout << "Replay matches the recording" << std::endl;
+	}
+
+	return 0;
+}